@@ -4,8 +4,8 @@
 // ****************************************************************************************************************************************************************
 // ****************************************************************************************************************************************************************
 // This is designed to run on an ESP8266 using FastLED, with optional use of Blynk for a phone App
-// It connects to an NTP time server, and sunrise/set server to determine time of day (UTC) and when the sun
-// will rise and set based on Longitude and Latitude co-ordinates.
+// It connects to an NTP time server to determine time of day (UTC) and works out when the sun
+// will rise and set based on Longitude and Latitude co-ordinates (Solar_calc).
 //
 // There are 3 modes of operation as set by the nightmode var.
 // 2005=Light bulb
@@ -59,19 +59,33 @@
 SoftwareSerial mySoftwareSerial(14, 16); // Declare pin RX & TX pins for TF Sound module.
 DFRobotDFPlayerMini myDFPlayer;
 
-#include <ESP8266HTTPClient.h>
+#include <ESP8266WebServer.h>
 #include <FastLED.h>
 #include <ArduinoJson.h>
-#include <WiFiManager.h>
+#include <DNSServer.h>
 #include <FS.h>
+#include <core_version.h>
+#if defined(ARDUINO_ESP8266_RELEASE_2_3_0) || defined(ARDUINO_ESP8266_RELEASE_2_4_0) || defined(ARDUINO_ESP8266_RELEASE_2_4_1) || \
+    defined(ARDUINO_ESP8266_RELEASE_2_4_2) || defined(ARDUINO_ESP8266_RELEASE_2_5_0) || defined(ARDUINO_ESP8266_RELEASE_2_5_1) || \
+    defined(ARDUINO_ESP8266_RELEASE_2_5_2)
+#error "Storage is LittleFS, which needs ESP8266 Arduino core 2.6.0 or later (update the espressif8266 platform)"
+#endif
+#include <LittleFS.h>
 #include <CapacitiveSensor.h>
 #include <ESP8266WiFiMulti.h>
 #include <ArduinoOTA.h>
-#include "ESP8266FtpServer.h"
+#include <SimpleFTPServer.h> //FTP on LittleFS.  The old ESP8266FtpServer only knows SPIFFS
+#if DEFAULT_STORAGE_TYPE_ESP8266 != STORAGE_LITTLEFS
+#error "SimpleFTPServer must be built for LittleFS (DEFAULT_STORAGE_TYPE_ESP8266 STORAGE_LITTLEFS in FtpServerKey.h)"
+#endif
 #include <BlynkSimpleEsp8266.h>
 #include <TimeLib.h> //https://github.com/PaulStoffregen/Time.git
 #include "BMP280.h"
 #include "Wire.h"
+extern "C" {
+#include "spi_flash.h"
+#include "user_interface.h"
+}
 
 #define P0 1013.25
 #define ELEVATION (100)             //Enter your elevation in m ASL to calculate rel pressure (ASL/QNH) at your place
@@ -91,22 +105,376 @@ float deltat = 0.0f, sum = 0.0f;          // integration interval for both filte
 uint32_t lastUpdate = 0, firstUpdate = 0; // used to calculate integration interval
 uint32_t Now = 0;                         // used to calculate integration interval
 
-//SPIFFS Filenames
-String HTTPfilename = "/APIaddress.txt"; //Filename for storing Sunrise API HTTP address in SPIFFS
-String modefilename = "/mode.txt";       //Filename for storing Sunrise Mode in SPIFFS (3 digits:  Mode, Top lamp, Flash)
-String UTCfilename = "/UTC.txt";         //Filename for storing Sunrise UTC in SPIFFS
-String chimefilename = "/chime.txt";     //Filename for storing Sunrise chime in SPIFFS
-String restartfilename = "/restart.txt"; //Filename for triggering restart in SPIFFS
-String resetfilename = "/reset.txt";     //Filename for triggering restart in SPIFFS
+//Storage.  All file access goes through Storage so the filesystem is only named here (and in Storage_migrate())
+FS &Storage = LittleFS;
+bool storage_mounted = false;
+bool storage_migrate_failed = false; //SPIFFS files that wouldn't fit in RAM to move, SPIFFS is kept and storage is off
+bool storage_benchmark = false; //true = time open/exists/read/append at every boot, see Storage_benchmark()
+
+//Storage Filenames
+String HTTPfilename = "/APIaddress.txt"; //Filename for storing Sunrise API HTTP address in storage
+String modefilename = "/mode.txt";       //Filename for storing Sunrise Mode in storage (3 digits:  Mode, Top lamp, Flash)
+String UTCfilename = "/UTC.txt";         //Filename for storing Sunrise UTC in storage
+String chimefilename = "/chime.txt";     //Filename for storing Sunrise chime in storage
+String configfilename = "/config.bin";   //Filename for the settings record in storage (replaces the four files above)
+String restartfilename = "/restart.txt"; //Filename for triggering restart in storage (uploaded by FTP or PUT /file)
+String resetfilename = "/reset.txt";     //Filename for triggering restart in storage
+
+//Fixed size history.  push() is O(1), the oldest entry drops off the end once full
+template <typename T, int N>
+class RingStore
+{
+public:
+  RingStore() { clear(); }
+
+  void clear()
+  {
+    head = 0;
+    count = 0;
+  }
+
+  void push(const T &value)
+  {
+    head = (head + 1) % N;
+    values[head] = value;
+    if (count < N)
+    {
+      count++;
+    }
+  }
+
+  const T &at(int age) const { return values[(head - age + N) % N]; } //age 0 = newest
+  const T &newest() const { return values[head]; }
+  const T &oldest() const { return at(count - 1); }
+  int size() const { return count; }
+  int capacity() const { return N; }
+  bool full() const { return count == N; }
+
+protected:
+  T values[N];
+  int head;
+  int count;
+};
+
+//Fixed size history of sensor readings.
+//A running sum, sum of squares and age weighted sum (newest reading is age 0) are kept up to date on every push so
+//averages and trends over the whole window cost O(1) whatever the window length.  Sums are integer so they never drift.
+template <typename T, int N>
+class RingBuffer : public RingStore<T, N>
+{
+public:
+  RingBuffer() { clear(); }
+
+  void clear()
+  {
+    RingStore<T, N>::clear();
+    running_sum = 0;
+    running_square_sum = 0;
+    running_age_sum = 0;
+  }
+
+  void push(T value)
+  {
+    if (this->full())
+    {
+      T oldest = this->at(N - 1);
+      running_sum -= oldest;
+      running_square_sum -= (long long)oldest * oldest;
+      running_age_sum -= (long)(N - 1) * oldest;
+    }
+
+    running_age_sum += running_sum; //Every reading already stored gets one step older
+    running_sum += value;
+    running_square_sum += (long long)value * value;
+
+    RingStore<T, N>::push(value);
+  }
+
+  long sum() const { return running_sum; }
+  long long square_sum() const { return running_square_sum; }
+  long age_weighted_sum() const { return running_age_sum; } //Sum of (age x reading)
+
+private:
+  long running_sum;
+  long long running_square_sum;
+  long running_age_sum;
+};
+
+//Least squares straight line through the readings of a RingBuffer, straight from its running sums.
+//slope is change per reading (+ve = rising towards the newest).  r_squared is the fit quality, 0 (noise) to 1 (perfect line)
+template <typename T, int N>
+void linear_fit(const RingBuffer<T, N> &history, float &slope, float &r_squared)
+{
+  slope = 0;
+  r_squared = 0;
+
+  long long n = history.size();
+  if (n < 2)
+  {
+    return;
+  }
+
+  //Ages are 0..n-1 so their sums are known without storing them
+  long long sum_age = n * (n - 1) / 2;
+  long long sum_age_squared = (n - 1) * n * (2 * n - 1) / 6;
+
+  //Everything x n to stay in integers until the last step
+  long long cov = n * history.age_weighted_sum() - sum_age * history.sum();
+  long long var_age = n * sum_age_squared - sum_age * sum_age;
+  long long var_value = n * history.square_sum() - (long long)history.sum() * history.sum();
+
+  slope = -(float)cov / var_age; //Age counts backwards in time, so flip the sign
+
+  if (var_value == 0)
+  {
+    r_squared = 1; //Flat line, perfect fit
+  }
+  else
+  {
+    r_squared = ((float)cov * cov) / ((float)var_age * var_value);
+  }
+}
+
+//Summary of the readings in one time bucket.  Values in 0.1 hPa
+struct Rollup
+{
+  int16_t min;
+  int16_t max;
+  uint32_t count;
+  int64_t sum;         //64 bits, a long query adds up a lot of readings
+  uint32_t start_time; //Unix time the bucket starts
+};
+
+void Rollup_merge(Rollup &into, const Rollup &from)
+{
+  if (from.count == 0)
+  {
+    return;
+  }
+
+  if (into.count == 0)
+  {
+    uint32_t start_time = into.start_time;
+    into = from;
+    into.start_time = start_time;
+    return;
+  }
+
+  if (from.min < into.min)
+  {
+    into.min = from.min;
+  }
+  if (from.max > into.max)
+  {
+    into.max = from.max;
+  }
+  into.sum += from.sum;
+  into.count += from.count;
+}
+
+//One resolution of rollups: the bucket being filled plus the last N finished buckets
+template <int N>
+class RollupTier
+{
+public:
+  RollupTier(uint32_t period_seconds) : period(period_seconds) { current.count = 0; }
+
+  //Add a reading or finer bucket.  If it starts a new bucket the finished one is returned in closed (and true)
+  bool add(const Rollup &reading, Rollup &closed)
+  {
+    uint32_t start = reading.start_time - reading.start_time % period;
+    bool finished = false;
+
+    if (current.count > 0 && start != current.start_time)
+    {
+      closed = current;
+      buckets.push(current);
+      current.count = 0;
+      finished = true;
+    }
+
+    if (current.count == 0)
+    {
+      current.start_time = start;
+    }
+    Rollup_merge(current, reading);
+    return finished;
+  }
+
+  RingStore<Rollup, N> buckets;
+  Rollup current;
+  uint32_t period;
+};
+
+//Min or max over a sliding time window, at most N values.  Monotonic deque, O(1) amortised per push
+template <int N>
+class MonotonicWindow
+{
+public:
+  MonotonicWindow(bool track_max) : is_max(track_max), front(0), length(0) {}
+
+  //Values from before time drop off the front
+  void expire(uint32_t time)
+  {
+    while (length > 0 && entries[front].time < time)
+    {
+      front = (front + 1) % N;
+      length--;
+    }
+  }
+
+  void push(uint32_t time, int value)
+  {
+    //Anything that can never be the answer again goes off the back
+    while (length > 0 && (is_max ? entries[back()].value <= value : entries[back()].value >= value))
+    {
+      length--;
+    }
+
+    if (length == N)
+    {
+      front = (front + 1) % N; //More values than the window holds, the oldest goes
+      length--;
+    }
+
+    int slot = (front + length) % N;
+    entries[slot].time = time;
+    entries[slot].value = value;
+    length++;
+  }
+
+  bool empty() const { return length == 0; }
+  int value() const { return entries[front].value; }
+
+private:
+  struct Entry
+  {
+    uint32_t time;
+    int value;
+  };
+  int back() const { return (front + length - 1) % N; }
+
+  Entry entries[N];
+  bool is_max;
+  int front;
+  int length;
+};
+
+//Min, max, mean over the finished buckets of a tier that started in the last span seconds.  Time based, so a gap in
+//the readings leaves less in the window rather than stretching it back.  The buckets themselves stay in the tier, the
+//window only counts how many of the newest are in it.  O(1) amortised per bucket
+template <int N>
+class RollupWindow
+{
+public:
+  RollupWindow(uint32_t span_seconds) : min_window(false), max_window(true), span(span_seconds), length(0), sum(0), count(0) {}
+
+  //bucket has just been pushed onto buckets (it's at(0))
+  template <int M>
+  void add(const RingStore<Rollup, M> &buckets, const Rollup &bucket, uint32_t now)
+  {
+    min_window.push(bucket.start_time, bucket.min);
+    max_window.push(bucket.start_time, bucket.max);
+    sum += bucket.sum;
+    count += bucket.count;
+    length++;
+    expire(buckets, now);
+  }
+
+  //Take out the buckets that started before now - span
+  template <int M>
+  void expire(const RingStore<Rollup, M> &buckets, uint32_t now)
+  {
+    uint32_t oldest = now - span;
+    if (length > buckets.size())
+    {
+      length = buckets.size();
+    }
+    while (length > 0 && buckets.at(length - 1).start_time < oldest)
+    {
+      sum -= buckets.at(length - 1).sum;
+      count -= buckets.at(length - 1).count;
+      length--;
+    }
+    min_window.expire(oldest);
+    max_window.expire(oldest);
+  }
+
+  Rollup summary() const
+  {
+    Rollup result;
+    result.count = 0;
+    result.start_time = 0;
+    if (count > 0)
+    {
+      result.min = min_window.value();
+      result.max = max_window.value();
+      result.sum = sum;
+      result.count = count;
+    }
+    return result;
+  }
+
+private:
+  MonotonicWindow<N> min_window;
+  MonotonicWindow<N> max_window;
+  uint32_t span;
+  int length;
+  int64_t sum;
+  long count;
+};
 
 //Pressure
 int pressure;
 int minpressure = 100000;
 int maxpressure = 0;
-int Zambrettiarraysize = 36;
-int Zambretti_array[36];  //Store readings for 3hr period
-long Zambretti_count = 1; //cycle from 1 to 36 for each 5min reading
+RingBuffer<int, 36> short_pressure_history; //Store 5min readings for 3hr period (storm watch), in 0.1 hPa
+
+//Pressure rollups (min / max / mean / count) at 3 resolutions, for "last day" / "last week" / range questions
+RollupTier<36> pressure_5min(5 * 60);     //3 hours of 5min buckets
+RollupTier<169> pressure_hourly(60 * 60); //1 week (+1) of hourly buckets
+RollupTier<62> pressure_daily(24 * 60 * 60); //2 months of daily buckets
+RollupWindow<24> pressure_day(24 * 60 * 60);       //Sliding last 24 hours, from the hourly buckets
+RollupWindow<168> pressure_week(7 * 24 * 60 * 60); //Sliding last week, from the hourly buckets
 long pressure_read_millis;
+
+//Storm early warning from the 5min readings
+bool storm_warning = false;     //true = pressure falling fast, LEDs go to storm
+bool storm_speak = true;        //Speak a warning when the storm warning starts (if sound enabled)
+float storm_tendency;           //Least squares trend of short_pressure_history in hPa per 3 hours
+float storm_hour_change;        //Change in hPa over the last hour
+float storm_tendency_on = -3.5; //Falling faster than this (hPa/3h) with a good fit starts a warning
+float storm_tendency_off = -1.5; //Warning clears once falling slower than this (hPa/3h) and the last hour has settled
+float storm_hour_drop = -2.0;   //Dropping more than this (hPa) within the last hour starts a warning straight away
+float storm_fit_min = 0.6;      //Min fit quality for the 3 hour trend to count
+int storm_min_readings = 6;     //Need 30mins of 5min readings before looking for a storm
+unsigned long storm_start_millis; //When the current storm warning started
+
+//Adaptive pressure sampling.  BMP280 startMeasurment() is a forced mode read, the sensor sleeps between reads
+uint32_t sample_slow_interval = 60 * 1000;     //Read every 60s while pressure is steady
+uint32_t sample_fast_interval = 5 * 1000;      //Read every 5s while pressure is moving
+uint32_t sample_fast_hold = 10 * 60 * 1000;    //Stay fast for 10mins after the last fast change
+float sample_fast_rate = 2.0;                  //hPa per hour trend over sample_trend_history to go fast
+uint32_t sample_interval = sample_slow_interval; //Interval in use
+unsigned long last_sample_millis, fast_sample_millis, sample_stats_millis, sample_trend_millis;
+RingBuffer<int, 30> sample_trend_history;      //1 reading a minute for 30mins whatever the sample rate, in 0.01 hPa
+int sample_trend_min = 15;                     //Need 15mins of readings before the trend counts (noise on fewer is too big)
+float sample_trend_rate;                       //Least squares trend of sample_trend_history in hPa per hour
+int sensor_conversion_ms;                   //Time the BMP280 was measuring for the last read
+int sensor_state = 0;                       //0 = idle, 1 = conversion started, waiting to collect
+unsigned long sensor_start_millis;          //When the conversion was started
+uint32_t sensor_failed = 0;                 //Count of failed / rejected reads since boot
+const float sensor_min_hPa = 300;           //BMP280 range, anything outside is a bad read
+const float sensor_max_hPa = 1100;
+
+//Pressure pre-filter
+int pressure_filter = 1;                    //0 = none, 1 = IIR, 2 = median of 3
+float pressure_iir_alpha = 0.25;            //IIR weight of the newest reading
+float pressure_iir;
+float pressure_median[3];
+uint32_t pressure_filter_count = 0;
+uint32_t samples_count, sensor_busy_ms;     //This hour so far
+const float sensor_measure_uA = 714;        //BMP280 current while measuring (datasheet), ~0.1uA asleep
 int write_timestamp;
 int accuracy_in_percent;
 int accuracygate = 12; //Must reach this level (12 x 30min) to give a forecast
@@ -117,8 +485,11 @@ float SLpressure_hPa; // needed for rel pressure calculation
 float HeatIndex;      // Heat Index in °C
 float volt;
 int rel_pressure_rounded;
-double DewpointTemperature;
+float DewpointTemperature;
 float DewPointSpread; // Difference between actual temperature and dewpoint
+bool derived_weather_valid = false; // Dewpoint, spread and heat index are worked out only when asked for (Derived_weather())
+const float SLpressure_factor = 1.0f / powf(1.0f - (float)ELEVATION / 44330.0f, 5.255f); // Absolute to sea level pressure, worked out once at boot
+uint32_t calc_cycles, derived_cycles; // CPU cycles for the last measurementEvent_calc() and Derived_weather()
 
 //Touch sensor
 int touchthreshold = 500; //Sensor min for touch
@@ -182,9 +553,172 @@ const int red_night = 0;
 const unsigned int localPort = 2390; // local port to listen for UDP packets
 const char *geiger = "http://192.168.1.105/j/";
 String geigerresponse;
+bool geiger_enabled = false; //true = read the Geiger counter at geiger every geiger_interval, see Geiger_check()
+const unsigned long geiger_interval = 60 * 1000UL;
+unsigned long geiger_millis = 0;
+
+//Outbound network, see Net_resolve() and Net_get().  Looked up addresses are kept for net_dns_ttl (the ESP8266 resolver
+//doesn't give the record's TTL) and HTTP connections are kept open between requests to the same host
+#define NET_DNS_ENTRIES 4
+#define NET_CONNECTIONS 2
+#define NET_HOST_SIZE 40
+struct NetDNSEntry
+{
+  char host[NET_HOST_SIZE];
+  IPAddress address;
+  unsigned long resolved_millis;
+};
+struct NetConnection
+{
+  WiFiClient client;
+  char host[NET_HOST_SIZE];
+  uint16_t port;
+  unsigned long used_millis;
+};
+NetDNSEntry net_dns[NET_DNS_ENTRIES];
+NetConnection net_connections[NET_CONNECTIONS];
+const unsigned long net_dns_ttl = 30 * 60 * 1000UL;
+const unsigned long net_timeout = 5000;                             //ms to connect, and for each wait on reply data
+uint32_t net_dns_lookups = 0, net_dns_hits = 0, net_dns_micros = 0; //net_dns_micros = the last lookup that went out
+uint32_t net_connects = 0, net_reuses = 0, net_connect_micros = 0;  //net_connect_micros = the last new connection
+
+//Body of the reply being read, as a Stream that ends where the body does (Content-Length or chunks), so a parser
+//reading it can't run on into whatever comes next on a kept-alive connection
+class NetBody : public Stream
+{
+public:
+  NetBody() : client(NULL), left(0), chunk_left(0), chunked(false), done(true), clean(false) {}
+
+  //length -1 = no Content-Length, the body runs until the server closes
+  void begin(WiFiClient *from, long length, bool is_chunked)
+  {
+    client = from;
+    left = length;
+    chunked = is_chunked;
+    chunk_left = 0;
+    done = (length == 0 && !is_chunked);
+    clean = done;
+  }
+
+  int available() { return wait() ? client->available() : 0; }
+  int peek() { return wait() ? client->peek() : -1; }
+  int read()
+  {
+    if (!wait())
+    {
+      return -1;
+    }
+    if (chunked)
+    {
+      chunk_left--;
+    }
+    else if (left > 0)
+    {
+      left--;
+    }
+    return client->read();
+  }
+  size_t write(uint8_t) { return 0; }
+
+  //Read off the rest of the body.  True if it all came, so the connection can be used again
+  bool finish()
+  {
+    while (wait())
+    {
+      read();
+    }
+    return clean;
+  }
+
+  WiFiClient *client;
+
+private:
+  //True once there's body data ready.  False at its end, or on a timeout
+  bool wait()
+  {
+    if (done)
+    {
+      return false;
+    }
+    if (!chunked && left == 0)
+    {
+      done = true;
+      clean = true;
+      return false;
+    }
+    if (chunked && chunk_left == 0 && !next_chunk())
+    {
+      done = true;
+      return false;
+    }
+
+    unsigned long start_millis = millis();
+    while (client->available() == 0)
+    {
+      if (!client->connected())
+      {
+        done = true;
+        clean = (left < 0 && !chunked); //Closed is the end when there's no length
+        return false;
+      }
+      if (millis() - start_millis > net_timeout)
+      {
+        done = true;
+        return false;
+      }
+      delay(1);
+    }
+    return true;
+  }
+
+  //Chunk size line (hex), after the CRLF that ends the previous chunk.  A 0 chunk is the end
+  bool next_chunk()
+  {
+    char line[16];
+    client->setTimeout(net_timeout);
+    if (left == 0) //Not the first chunk (left is only used as this marker when chunked)
+    {
+      client->readBytesUntil('\n', line, sizeof(line));
+    }
+    left = 0;
+    size_t length = client->readBytesUntil('\n', line, sizeof(line) - 1);
+    line[length] = 0;
+    chunk_left = strtol(line, NULL, 16);
+    if (length == 0 || chunk_left <= 0)
+    {
+      client->readBytesUntil('\n', line, sizeof(line)); //Blank line after the last chunk
+      clean = (length > 0);
+      return false;
+    }
+    return true;
+  }
+
+  long left;
+  long chunk_left;
+  bool chunked;
+  bool done;
+  bool clean;
+};
 String recovered_ssid;
 String recovered_pass;
 
+//WiFi, see WiFi_and_Credentials().  If the saved WiFi can't be joined the lamp opens its own setup portal: an access
+//point, DNS that answers every name with us and a page for the WiFi and settings.  Run from loop() so the lamp keeps
+//going while it's open
+const char *portal_ssid = "WiFi_Lamp";
+DNSServer portal_dns;
+ESP8266WebServer portal_server(80); //Only while the portal is open, server (the local API) has port 80 after
+bool portal_open = false;
+unsigned long wifi_connect_millis = 0;            //When joining the WiFi was last started
+const unsigned long wifi_connect_timeout = 15000; //Open the portal if it hasn't joined by then
+//Settings as typed on the portal page, "" = left blank
+char portal_latitude[11];
+char portal_longitude[11];
+char portal_mode[5];
+char portal_UTC[4];
+char portal_chime[26];
+bool wifi_online = false; //Connected and the network services started, see WiFi_online()
+
 //Duck touch & sound vars
 uint32_t Duckaction_millis = millis();
 int Duck_quack_mp3, Duck_north_mp3, Duck_north_LED, Duck_north_mp3_flag = 0;
@@ -199,53 +733,119 @@ int touchSwapmin = 4000;     //this value or more to go into UTC change
 
 //Millis Unix_timestmap update
 unsigned long millis_unix_timestamp;
-char UTC[3];
-int RequestedTime = 0, TimeCheckLoop = 0, NTPdelaycounter = 0;
+int RequestedTime = 0, TimeCheckLoop = 0;
 int hour_UTC, minute_UTC, second_UTC;   
 int hour_actual = 200, dia_actual = 0, anyo = 0;
 int timeout = 0, timeout_prev = 0;
 int vera = 0, night = 0;                                                                                //1 = Night, 0 = Day
 const int NTP_PACKET_SIZE = 48;                                                                         // NTP time stamp is in the first 48 bytes of the message
 byte packetBuffer[NTP_PACKET_SIZE];                                                                     //buffer to hold incoming and outgoing packets
-unsigned long epoch = 0, lastepoch = 0, Last_NTP_millis = 0, LastAPI, LastLED, epochstart, startmillis; //Unix time in seconds
-int lastepochcount = 1, totalfailepoch = 0;
+unsigned long epoch = 0, lastepoch = 0, Last_NTP_millis = 0, LastLED, epochstart, startmillis; //Unix time in seconds
+int totalfailepoch = 0;
 int clock_minutes_from_midnight, local_clock_minutes_from_midnight; //Minutes from midnight
 int NTP_Seconds_to_wait = 1;                                        //Initial wait time between NTP/Sunrise pulls (1 sec)
-String clock_AMPM;                                                  //AM/PM from NTP Server
 int printNTP = 0;                                                   //Set to 1 when a NTP is pulled.  The decode_epoch function used for both NTP epoch and millis epoch.  printNTP=1 in this fucnction only print new NTP results (time).
 int Seconds_SinceLast_NTP_millis;                                   //Counts seconds since last NTP pull
 int retryNTP = 0;                                                   //Counts the number of times the NTP Server request has had to retry
 int UTC_Cycle = 152;
 unsigned long currentMillis = millis();
-const char *NTPServerName = "0.nz.pool.ntp.org"; //local NTP server
+
+//NTP: every server is asked at once and the best reply is used, see Check_Time() and NTP_select()
+#define NTP_SERVERS 4
+struct NTPServer
+{
+  const char *name;
+  IPAddress address;
+  unsigned long sent_millis; //When this round's request went, 0 = not asked this round
+  bool answered;             //This round
+  int32_t delay_ms;          //Round trip less the server's own time, this round
+  int64_t millis_offset;     //Unix time (ms) less millis(), from this round's reply
+  int32_t offset_ms;         //Against our clock when the reply came (0 before the clock is set)
+  uint32_t requests, replies;
+  uint32_t delay_total_ms; //For the average round trip
+};
+NTPServer ntp_servers[NTP_SERVERS] = {{"0.nz.pool.ntp.org"}, {"1.nz.pool.ntp.org"}, {"2.nz.pool.ntp.org"}, {NTP_SERVER}}; //Local ones first
+uint32_t ntp_nonce = 0;                       //Sent in each request, must come back in the reply
+unsigned long ntp_first_reply_millis = 0;     //0 = no reply yet this round
+const unsigned long ntp_collect_millis = 500; //After the first reply, wait this long for the others
+const int32_t ntp_tolerance_ms = 100;         //Extra allowance when checking replies agree
+int ntp_chosen = -1;                          //Server the clock was last set from
 
 //Time delays
 uint32_t delayamount = 2000;                     //LED update delay
 uint32_t zambretti_delayamount = 30 * 60 * 1000; //Update Zambretti
 uint32_t showtime_delayamount = 60 * 1000;       //Display local every 60s
 uint32_t pressure_read_interval = 5 * 60 * 1000; //5mins x 60 sec x 1000 millis
-const int minswithin = 60;      //Minutes within sunrise / sunset to begin the LED colour change sequence  (60 = phase starts 30mins before sunrise/set and end 30mins after)
+
+//5 minute readings taken before the clock is known.  Logged with their real time once it is, see TS_pending_flush()
+struct PendingReading
+{
+  unsigned long read_millis;
+  int16_t pressure_tenths;
+  int16_t temp_tenths;
+};
+RingStore<PendingReading, 24> pending_readings; //2 hours, older ones drop off
 const int change = 1;           //Speed of LED change in tones.  Recommend = 1
 int NTPSecondstowait = 1 * 60 * 60; //Wait between NTP pulls (sec)
 int APISecondstowait = 6 * 60 * 60; //Wait between Sunrise API pulls (sec)
-int SecondsSinceLastAPI = 0;
+bool sunrise_api_check = false;     //true = also get sunrise/set from the API to cross check Solar_calc() and the sun table
+
+//Sunrise API scheduling, see API_check().  Failures back off (doubling, with jitter) and every wait gets some jitter so
+//lamps that started together don't all ask at once.  The next day is fetched shortly before local midnight
+const uint32_t api_jitter_seconds = 10 * 60;       //Up to this much added to each wait
+const uint32_t api_retry_seconds = 60;             //First retry after a failure
+const uint32_t api_retry_max_seconds = 6 * 60 * 60; //Longest wait between retries
+const uint32_t api_prefetch_seconds = 30 * 60;     //Get tomorrow this long before local midnight
+const uint32_t api_valid_seconds = 36 * 60 * 60;   //Held API times are no use after this
+bool api_scheduled = false;
+unsigned long api_next_millis = 0; //When API_check() next does anything
+unsigned long api_wait_millis = 0;
+int api_failures = 0;              //In a row
+uint32_t api_requests = 0, api_request_failures = 0;
+uint32_t api_heap_lowest, api_block_lowest; //Least free heap and smallest largest free block in the last API request
+uint32_t api_day = 0;          //Local date (days since 1970) the held times are for, 0 = none
+uint32_t api_fetched_time = 0; //UTC they were got
+int api_sunrise_minutes = -1, api_sunset_minutes = -1; //UTC minutes from midnight
 int timefactor = 1; //Used for testing to accelerate time
 
 //Sunrise - Sunset API variables
-char sunrise_api_request[100]; //It should end up containing an adress like this "http://api.sunrise-sunset.org/json?lat=-41.2865&lng=174.7762";
-int h_sunrise, hour_sunrise, minute_sunrise, sunrise_minutes_from_midnight, local_sunrise_minutes_from_midnight;
-int SR_Phase = 0; //1 = in Sunrise phase (30 mins either side if minwithin = 60mins)
-int h_sunset, hour_sunset, minute_sunset, sunset_minutes_from_midnight, local_sunset_minutes_from_midnight;
-int SS_Phase = 0;            //1 = in Sunset phase (30 mins either side if minwithin = 60mins)
-int working_hourtomin = 0;   //Used to convert hours into total minutes
-float LED_phase;             //0-255 in the phase of sunrise/set   0=begining 255=end
-char SR_AMPM[1], SS_AMPM[1]; //Sunrise/set AMPM
-String AMPM, sunAPIresponse;
-String JSON_Extract(String);
-char mode[4];      //Used to get input from webpage
-int SRSS_Flip = 0; //Used to manipulate SR and SS varible if in nightlight mode
-
-//Lightmode, TARDIS, Longitude/Latitude and UTC are stated here but overwritten when webpage credentials are entered (if using WiFi Manager)
+char sunrise_api_request[100]; //It should end up containing an adress like this "http://api.sunrise-sunset.org/json?lat=-41.2865&lng=174.7762&formatted=0";
+int sunrise_minutes_from_midnight, local_sunrise_minutes_from_midnight;
+int sunset_minutes_from_midnight, local_sunset_minutes_from_midnight;
+
+//Sun for the day, see Solar_calc().  UTC minutes from midnight
+float solar_sunrise, solar_sunset, civil_dawn, civil_dusk, nautical_dawn, nautical_dusk;
+float solar_noon, solar_declination; //solar_declination in radians
+uint32_t solar_day = 0;              //Days since 1970 the values are for
+bool solar_valid = false;
+uint32_t solar_cycles = 0;           //CPU cycles the last Solar_calc() took (table read or the full sums)
+#define SOLAR_DEG_TO_RAD 0.017453293f //float, the Arduino ones are double
+#define SOLAR_RAD_TO_DEG 57.29578f
+
+//Sky colour for every 5 minutes of the UTC day, from the sun's elevation.  Built once a day by Sky_build(), each LED
+//frame only interpolates between two slots
+#define SKY_SLOT_MINUTES 5
+#define SKY_SLOTS (1440 / SKY_SLOT_MINUTES)
+struct SkyStop
+{
+  float elevation; //Degrees
+  uint8_t red, green, blue;
+};
+#define SKY_STOPS_MAX 4 //Stops in the longest curve, see Sky_build()
+CRGB sky_curve[SKY_SLOTS + 1]; //+1 so the last slot can interpolate to midnight
+bool sky_valid = false;
+uint32_t sky_build_micros = 0;
+//Sunrise API reply with formatted=0, as captured:
+//{"results":{"sunrise":"2024-06-21T19:47:12+00:00","sunset":"2024-06-22T05:02:45+00:00","solar_noon":"2024-06-22T00:24:58+00:00",
+//"day_length":33333,"civil_twilight_begin":"2024-06-21T19:15:31+00:00","civil_twilight_end":"2024-06-22T05:34:26+00:00",
+//"nautical_twilight_begin":"2024-06-21T18:39:58+00:00","nautical_twilight_end":"2024-06-22T06:09:59+00:00",
+//"astronomical_twilight_begin":"2024-06-21T18:05:52+00:00","astronomical_twilight_end":"2024-06-22T06:44:05+00:00"},"status":"OK","tzid":"UTC"}
+//Keys and strings are copied in when parsing a stream: 438 bytes with terminators for the reply above, plus up to 3 bytes
+//alignment on each of the 25.  Objects 224 bytes, so about 740 in all; the rest is room for the API adding a field
+const size_t sunrise_json_strings = 438 + 25 * 3;
+const size_t sunrise_json_size = JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(10) + sunrise_json_strings + 160;
+
+//Lightmode, TARDIS, Longitude/Latitude and UTC are stated here but overwritten when they are entered on the setup portal page
 int localUTC = 12;                               //Country UTC offset, needed for UTC for day/night calc  (+12 for NZ)  don't need to change for daylight saving as no needed for day/night
 int UTCoffset = 0;                               //Set my user with touch button +1, -1, 0
 int lightmode = 0;                               //0 = day/night (day = Yellow / night = Blue   e.g TARDIS Lamp)    1 = night light mode with sunrise/set colour changes (but off during daytime)    2 = night light mode without sunrise/set changes  (binary on (day) /off (night))
@@ -268,18 +868,206 @@ int red = 0;
 //Create an array with 0-255 sine wave with array 0-31
 char sinetable[] = {127, 152, 176, 198, 217, 233, 245, 252, 254, 252, 245, 233, 217, 198, 176, 152, 128, 103, 79, 57, 38, 22, 38, 57, 79, 103};
 
-//Array for the chime hours to go into.  24 digits starting with midnight.  0=no chime, 1=chime.  e.g 0000001111111111111111100
-char chime[26];
+//Settings record, see Config_load().  Everything the setup portal page sets
+#define CONFIG_MAGIC 0x47464E43 //"CNFG"
+#define CONFIG_VERSION 1
+struct ConfigRecord
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size; //sizeof(ConfigRecord) when written
+  float latitude;
+  float longitude;
+  int8_t lightmode;    //0-2
+  int8_t TARDIS;       //0-4
+  int8_t flash;        //0-9
+  int8_t brightness;   //1-5
+  int8_t volume;       //0-9
+  int8_t UTC;          //-13 to 13
+  uint8_t reserved[2];
+  uint32_t chime_mask; //Chime hours, bit 0 = midnight.  Entered as 24 digits 0=no chime, 1=chime.  e.g 000000111111111111111110
+  uint32_t crc;        //Over everything before it
+};
+ConfigRecord config;
+float latitude, longitude;
+uint32_t chime_mask = 0;
+uint32_t config_load_micros = 0;
+bool config_loaded = false; //false = no saved settings, running on defaults until some are entered on the portal page
+
+//Restart / reload requests, raised in RAM by Restart_request() and Reload_request() (Blynk, /restart.txt, local API)
+bool restart_pending = false;
+bool reload_pending = false;
+unsigned long restart_request_millis;
+const unsigned long restart_delay = 5000; //Time to finish off (e.g. FTP or web reply) before restarting
+
+//Settings changed through the local API are saved once they've been left alone for config_save_delay
+bool config_save_pending = false;
+unsigned long config_save_millis;
+const unsigned long config_save_delay = 10000;
 
 //Print var
 int verbose_output = 0; // 0 = No serial print, 1 = serial print
 
+//Boot timeline, see Boot_mark()
+#define BOOT_MAX_MARKS 16
+const char *boot_phase[BOOT_MAX_MARKS];
+unsigned long boot_millis[BOOT_MAX_MARKS];
+int boot_marks = 0;
+bool boot_report_done = false;
+bool boot_test_LEDs = false; //true = 3 sec red/green/blue test at boot
+
+//First NTP time, see Time_boot_check()
+bool time_valid = false;
+unsigned long time_request_millis, time_poll_millis;
+const unsigned long time_poll_interval = 10; //Often, each NTP reply's arrival time goes into its round trip
+
+//Warm restart snapshot in RTC user memory, see RTC_restore().  The first 128 bytes of user memory are left for OTA
+#define RTC_MAGIC 0x4D525752 //"RWRM"
+#define RTC_OFFSET 32        //4 byte blocks
+#define RTC_WORKING_MODE 0x01
+#define RTC_STORM 0x02
+struct RTCSnapshot
+{
+  uint32_t magic;
+  uint32_t epoch;      //UTC when written
+  uint32_t rtc_time;   //RTC clock periods when written.  Keeps counting through a restart
+  uint32_t rtc_period; //us per RTC period << 12, from system_rtc_clock_cali_proc()
+  int8_t UTCoffset;
+  uint8_t flags;
+  uint16_t short_count;
+  int16_t short_pressure[36]; //short_pressure_history, oldest first
+  uint32_t crc;
+};
+bool rtc_restored = false;
+unsigned long rtc_save_millis = 0;
+const unsigned long rtc_save_interval = 60000;
+
+//DFPlayer start up, see Audio_boot_check().  audio_state 0 = starting, 1 = ready, 2-4 = boot speech, -1 = no player
+int audio_state = 0;
+unsigned long audio_start_millis, audio_speak_millis;
+int audio_clips[4]; //Boot speech mp3s from SpeakClock_clips(), played one a second
+int audio_clip_count, audio_clip;
+const unsigned long audio_boot_timeout = 5000;
+
 // FORECAST CALCULATION
 unsigned long current_timestamp; // Actual timestamp read from NTPtime_t now;
-unsigned long saved_timestamp;   // Timestamp stored in SPIFFS
+unsigned long saved_timestamp;   // Timestamp stored in the pressure log
+
+//Binary pressure log.  Two files (A/B), each a header then 12 byte records appended every 30mins.
+//Replaying the records rebuilds pressure_history.  Compaction writes a fresh snapshot into the other file
+#define LOG_MAGIC 0x474F4C50 //"PLOG"
+#define LOG_VERSION 1
+#define LOG_RECORD_SAMPLE 0  //Push pressure onto the history
+#define LOG_RECORD_RESET 1   //Fill the history with pressure
+struct LogHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+  uint32_t snapshot_records; //Records written with the header, the file isn't good until they are all there
+  uint32_t sequence;         //Higher = newer of the A/B files
+  uint32_t crc;
+};
+struct LogRecord
+{
+  uint32_t timestamp;
+  int16_t pressure;
+  uint8_t accuracy;
+  uint8_t type;
+  uint32_t crc;
+};
+const char *log_filenames[2] = {"/data_a.bin", "/data_b.bin"};
+int log_active = -1;           //0 = A, 1 = B, -1 = none yet
+uint32_t log_sequence = 0;
+int log_records = 0;           //Records in the active file
+int log_compact_records = 240; //About 5 days of 30min records before compacting
+
+//History store (weeks of 5min pressure and temperature), see TS_append()
+#define TS_MAGIC 0x53454954   //"TIES"
+#define TS_BLOCK_SIZE 256     //Bytes per block, in RAM and in flash
+#define TS_SECTORS 8          //4k flash sectors reserved for history (32k), about 4 weeks at 5min readings
+#define TS_BLOCKS_PER_SECTOR (SPI_FLASH_SEC_SIZE / TS_BLOCK_SIZE)
+#define TS_BLOCKS (TS_SECTORS * TS_BLOCKS_PER_SECTOR)
+#define TS_SERIES 2           //0 = pressure (0.1 hPa), 1 = temperature (0.1 C)
+#define TS_MAX_SAMPLE_BITS 124 //Worst case bits for one reading (time + both values)
+struct TSBlock
+{
+  uint32_t magic;
+  uint32_t sequence;   //Block number, slot in the flash is sequence % TS_BLOCKS
+  uint32_t start_time; //Unix time the first reading is delta'd from
+  uint32_t count;      //Readings in the block
+  uint32_t bits;       //Bits of payload used
+  uint32_t crc;        //Over the whole block except this word
+  uint8_t payload[TS_BLOCK_SIZE - 24];
+};
+//All fields are 32 bit so blocks can be read in place from mapped flash, which only allows aligned 32 bit loads
+#define TS_CRC_WORD 5
+#define TS_PAYLOAD_BITS ((TS_BLOCK_SIZE - 24) * 8)
+struct TSState
+{
+  uint32_t time;
+  int32_t delta;
+  uint32_t value[TS_SERIES];
+  uint8_t leading[TS_SERIES];    //XOR window: leading zeros
+  uint8_t meaningful[TS_SERIES]; //XOR window: meaningful bits, 0 = no window yet
+  uint16_t bit;                  //Next bit to read/write in the payload
+};
+//Flash kept for our own records: the top 10 sectors of the first megabyte, history first then the sun table.  It's inside
+//the 0x40200000 memory mapped window so it can be read in place, and at a fixed place above the sketch so serial and OTA
+//updates leave it alone (OTA stages the new sketch just below the filesystem, 3MB up on the 4M1M layout).
+//Flash_reserved_check() makes sure the sketch hasn't grown into it
+#define FLASH_MAPPED 0x40200000
+#define FLASH_RESERVED_START 0xF6000
+#define FLASH_RESERVED_END 0x100000
+extern "C" uint32_t _FS_start;
+bool flash_reserved_ok = false;
+#define TS_FLASH_START FLASH_RESERVED_START
+const uint8_t *history_flash = (const uint8_t *)(FLASH_MAPPED + TS_FLASH_START);
+TSBlock ts_block;        //Block being filled in RAM
+TSState ts_writer;       //Encoder state for ts_block
+uint32_t ts_sequence;    //Sequence number of ts_block (= blocks written so far)
+uint32_t ts_append_micros; //Time taken by the last TS_append()
+
+//Sun table: a year of Solar_compute() results for the stored place, see Sun_table_build().  In the reserved flash, after
+//the history
+#define SUN_MAGIC 0x314E5553 //"SUN1"
+#define SUN_DAYS 366
+#define SUN_SECTORS 2
+#define SUN_FLASH_START (TS_FLASH_START + TS_SECTORS * SPI_FLASH_SEC_SIZE)
+#define SUN_BUILD_SLICE 8 //Days worked out and written per loop pass by Sun_table_step()
+struct SunTableHeader
+{
+  uint32_t magic;
+  uint32_t year;
+  float latitude;
+  float longitude;
+  uint32_t days;
+  uint32_t crc; //Over the days
+};
+//One day.  Times are UTC from midnight in 0.1 minutes (negative = the day before), declination in 0.0001 radians
+struct SunDay
+{
+  int16_t sunrise;
+  int16_t sunset;
+  int16_t civil_dawn;
+  int16_t civil_dusk;
+  int16_t nautical_dawn;
+  int16_t nautical_dusk;
+  int16_t noon;
+  int16_t declination;
+};
+const uint8_t *sun_flash = (const uint8_t *)(FLASH_MAPPED + SUN_FLASH_START);
+const SunDay *sun_flash_days = (const SunDay *)(sun_flash + sizeof(SunTableHeader));
+int sun_table_year = 0;   //Year the flash table has been checked good for, 0 = not yet
+int sun_build_year = 0;   //Year Sun_table_step() is building, 0 = not building
+int sun_build_tried = 0;  //Year the last build was started for, so a failed one isn't started again every day
+int sun_build_next;       //Next day to write, negative = sectors still to erase
+uint32_t sun_build_crc;   //CRC of the days written so far
+uint32_t sun_build_micros; //Time spent building so far
 unsigned long millis_unix_timestamp_baseline;
-float pressure_value[12];      // Array for the historical pressure values (6 hours, all 30 mins)
-float pressure_difference[12]; // Array to calculate trend with pressure differences
+RingBuffer<int, 12> pressure_history; // Historical pressure values (6 hours, all 30 mins).  at(0) is the newest
+float pressure_tendency;              // Least squares trend of pressure_history in hPa per 3 hours
+float pressure_fit;                   // Fit quality (r squared) of the pressure_tendency.  0 = noise, 1 = straight line
 
 // FORECAST RESULT
 int accuracy;           // Counter, if enough values for accurate forecasting
@@ -333,44 +1121,149 @@ void Timekeeping();
 void Touchsensor_check();
 void StartOTA();
 void Startsensor();
-void WiFi_start();
 void Test_LEDs();
 void weather_DotheLEDs();
 void nightday_DoTheLEDs();
 void Duck_movement();
 void Pressure_handle();
+void Rollup_add(uint32_t time, int value);
+Rollup Rollup_query(uint32_t from, uint32_t to);
+void Rollup_seed();
+void Web_get_pressure();
+void Rollup_print(const char *name, const Rollup &r);
 void LEDrange();
-void API_Request();
+bool API_Request(uint32_t local_day);
+bool API_fetch(uint32_t local_day);
+void API_heap_sample();
+bool Net_resolve(const char *host, IPAddress &address);
+int Net_get(const char *url, NetBody &body);
+void Net_end(NetBody &body);
+void Geiger_check();
+void API_compare();
+long API_stale_seconds();
 void Zambretti_calc();
 void measurementEvent();
+void measurementEvent_calc();
+void Derived_weather();
+void Derived_weather_benchmark();
+bool Sensor_start();
+bool Sensor_collect();
+float Pressure_filter(float raw);
+float Pressure_filter_latency();
 void ReadFromSPIFFS();
-void WriteToSPIFFS(int write_timestamp);
+void ReadFromSPIFFS_text();
+void WriteToSPIFFS(uint32_t write_timestamp);
+uint32_t crc32_calc(const uint8_t *data, size_t length, uint32_t crc = 0);
+bool Log_check(const char *filename, uint32_t &sequence, int &records, bool &torn);
+void Log_replay(const char *filename);
+void Log_append(uint8_t type, uint32_t timestamp, int value);
+void Log_compact();
+void TS_begin();
+void TS_append(uint32_t time, int pressure_tenths, int temp_tenths);
+void TS_flush();
+void TS_save();
+void Flash_reserved_check();
+bool TS_slot_blank(uint32_t slot);
+void TS_find_end();
+int TS_scan(uint32_t from_time, void (*callback)(uint32_t, int, int));
 void do_blynk();
-void SPIFFS_init();
+void Storage_begin();
+bool Storage_migrate();
+void Storage_benchmark(FS &fs, const char *name);
 void Zambretti_nocalc();
+void Storm_check();
+void Pressure_sample_check();
 void UpdateSPIFFS();
 void FirstTimeRun();
 void Request_Time();
 void sendNTPpacket(const IPAddress &address);
 void update_epoch_time();
 void decode_epoch(unsigned long currentTime);
-void initiate_time();
+void Boot_mark(const char *phase);
+void Boot_report();
+void Boot_first_frame();
+void Time_boot_check();
+void Audio_begin();
+void Audio_boot_check();
+void RTC_save();
+void RTC_clear();
+void RTC_check();
+bool RTC_restore();
+void Config_begin();
+bool Solar_event(float zenith_deg, float &rise, float &set);
+void Solar_compute(uint32_t day);
+void Solar_calc(uint32_t time);
+uint32_t Sun_year_first_day(int year);
+bool Sun_table_valid(int year);
+void Sun_table_build(int year);
+void Sun_table_step();
+int API_iso_minutes(const char *text);
 void LocalClock();
 bool Check_Time(); //Check time is correct and ok
+uint32_t NTP_word(const byte *data);
+int64_t NTP_unix_ms(const byte *data);
+void NTP_sample(const IPAddress &from, unsigned long receive_millis);
+int NTP_select();
+void NTP_report();
 void daynight();
+CRGB Sky_stop_colour(const SkyStop *stops, int count, float elevation);
+void Sky_build();
+CRGB Sky_colour(uint32_t time);
 void nightlight();
-void sunrise_sunset();
 void checkreset(int);                         //Check if reset button has been pressed
 void API_check(); 
 void WiFi_and_Credentials();
+void WiFi_check();
+void WiFi_online();
+void Portal_start();
+void Portal_stop();
+void Portal_page();
+void Portal_save();
+void Portal_redirect();
+void Portal_arg(const char *name, char *text, size_t size);
+void Portal_settings_apply();
+void Config_merge_mode(ConfigRecord &record, const char *text);
+void Config_merge_chime(ConfigRecord &record, const char *text);
+void TS_pending_flush();
+int Config_digit(const char *text, int index);
+void Config_from_text(float lat, float lng, const char *mode_text, const char *utc_text, const char *chime_text);
+bool Config_valid(const ConfigRecord &record);
+void Config_check(ConfigRecord &record);
+void Config_apply();
+void Restart_request(const char *reason);
+void Reload_request(const char *reason);
+void Restart_check();
+void Config_update(const ConfigRecord &record, bool save);
+void Config_save_check();
+const char *Config_range_error(const ConfigRecord &record);
+String Config_json();
+void Web_send_error(int code, const String &error);
+bool Web_authorised();
+bool Web_int_field(JsonObject &root, const char *key, int low, int high, int8_t &field);
+bool Web_float_field(JsonObject &root, const char *key, float low, float high, float &field);
+void Web_get_config();
+void Web_post_config();
+void Web_post_restart();
+void Web_post_reload();
+void Web_get_sunrise();
+void Web_get_net();
+void Web_get_ntp();
+void Web_put_file();
+void FTP_transfer(FtpTransferOperation operation, const char *name, unsigned int size);
+void Web_begin();
+void Config_save();
+bool Config_load(ConfigRecord &record);
+void Config_read_text(const String &filename, char *text, size_t size);
+bool Config_text_override(ConfigRecord &record);
 void Flip_modes();
 void SpeakClock();
+int SpeakClock_clips(int *clips);
 
 //Classes
 WiFiUDP udp;                // A UDP instance to let us send and receive packets over UDP
 ESP8266WiFiMulti wifiMulti; // Create an instance of the ESP8266WiFiMulti class, called 'wifiMulti'
-IPAddress timeServer;
 FtpServer ftpSrv;
+ESP8266WebServer server(80); //Local control API, see Web_begin()
 uint32_t getmillis1, getmillis2;
 BMP280 bmp;
 
@@ -380,11 +1273,26 @@ BLYNK_WRITE(V1)
   if (param.asInt() == 1)
   {
     // assigning incoming value from pin V1 to a variable
-    Serial.println("Formatting SPIFFs");
-    SPIFFS.format();
-    delay(2000);
+    Serial.println("Formatting storage");
+    Storage.format();
     //FirstTimeRun();
-    ESP.restart();
+    Restart_request("Blynk format");
+  }
+}
+
+BLYNK_WRITE(V4)
+{
+  if (param.asInt() == 1)
+  {
+    Restart_request("Blynk");
+  }
+}
+
+BLYNK_WRITE(V5)
+{
+  if (param.asInt() == 1)
+  {
+    Reload_request("Blynk");
   }
 }
 
@@ -407,40 +1315,17 @@ BLYNK_WRITE(V3)
 void setup()
 {
   Serial.begin(9600);
+  Boot_mark("serial");
 
-  //DF Sound player setup
-  mySoftwareSerial.begin(9600);
-  myDFPlayer.setTimeOut (2000);
-
-  Serial.println();
-  Serial.println(F("DFRobot DFPlayer Mini Demo"));
-  Serial.println(F("Initializing DFPlayer ... (May take 3~5 seconds)"));
-  
-  if (!myDFPlayer.begin(mySoftwareSerial, false)) {  //Use softwareSerial to communicate with mp3.
-    Serial.println(F("Unable to begin:"));
-    Serial.println(F("1.Please recheck the connection!"));
-    Serial.println(F("2.Please insert the SD card!"));
-    while(true){
-      delay(0); // Code to compatible with ESP8266 watch dog.
-    }
-  }
-  Serial.println(F("DFPlayer Mini online."));
-  
-  myDFPlayer.volume(20);  //Set volume value. From 0 to 30
-
-  //WiFi_start();
-  WiFi_and_Credentials();
-
-  delay(1000);
+  Flash_reserved_check(); //Before anything reads the history or the sun table
 
-  //Get initial sunrise/set times
-  API_Request(); //Get sunrise/sunset times.  Do this after Test section in case API HTTP overridden
-  StartOTA();
+  //Settings first, the LEDs need them.  No WiFi needed
+  Storage_begin();
+  Config_begin();
+  Boot_mark("settings");
 
-  //Blynk.begin(auth, ssid, pass);  //Blynk setup (if being used).
-  //Blynk.begin(auth, WiFi.SSID().c_str(), pass);
-  Blynk.config(auth);
-  Blynk.connect();
+  rtc_restored = RTC_restore(); //Clock, pressure ring and modes from before a restart
+  Boot_mark("RTC memory");
 
   FastLED.addLeds<WS2811, PIN_LED, COLOR_ORDER>(leds, NUM_LEDS_PER_STRIP); //Initialise the LEDs
 
@@ -452,7 +1337,18 @@ void setup()
 
   pinMode(0, INPUT); //Reset button initialisation.  GPIO0 (D3) to GND to reset ESP2866 Credentials
 
+  if (boot_test_LEDs == true)
+  {
+    Test_LEDs();
+  }
+  Boot_mark("LEDs");
+
+  //DF Sound player setup.  The module takes a few seconds, Audio_boot_check() in loop() waits for it
+  Audio_begin();
+  Boot_mark("audio start");
+
   //BMP setup
+  Wire.begin(); //Initial I2C bus
   if(!bmp.begin()){
     Serial.println("BMP init failed!");
     while(1);
@@ -461,115 +1357,43 @@ void setup()
   
   bmp.setOversampling(4);
 
-  Wire.begin(); //Initial I2C bus
-  delay(1000);
-  //Startsensor();
-  Test_LEDs();
-
-  //Initiate array with 0 (no value = no prediction)
-  for (int x = 1; x <= Zambrettiarraysize; x++)
-  {
-    Zambretti_array[x] = 990;
-  }
-
-  pressure_read_millis = millis();
-
-  //******** GETTING THE TIME FROM NTP SERVER  ***********************************
-  initiate_time(); //Get NTP and time set up for the first time
-  decode_epoch(epoch); //epoch has been updated, Now turn this into UTC clock_minutes_from_midnight
-  
-  //current_timestamp = ntpClient.getUnixTime(); // get UNIX timestamp (seconds from 1.1.1970 on)
-  saved_timestamp = current_timestamp;
-  millis_unix_timestamp = millis(); //millis time tracking reset to current millis when getting new NTP time
-  millis_unix_timestamp_baseline = current_timestamp;
-
-  Serial.print("Current UNIX Timestamp: ");
-  Serial.println(current_timestamp);
-  Serial.print("Time & Date: ");
-  Serial.print(hour(current_timestamp));
-  Serial.print(":");
-  Serial.print(minute(current_timestamp));
-  Serial.print(":");
-  Serial.print(second(current_timestamp));
-  Serial.print("; ");
-  Serial.print(day(current_timestamp));
-  Serial.print(".");
-  Serial.print(month(current_timestamp)); // needed later: month as integer for Zambretti calcualtion
-  Serial.print(".");
-  Serial.println(year(current_timestamp));
-
-  SPIFFS_init();
-
-  if (SPIFFS.begin())
-  {
-    Serial.println("SPIFFS opened!");
-    Serial.println("");
-  }
-
-  ftpSrv.begin(recovered_ssid, recovered_pass); // username, password for ftp. Set ports in ESP8266FtpServer.h (default 21, 50009 for PASV)
-
   //Initial run - Do this now so if rebooted gets old data and starts with history, otherwise we wait for 30mins for this to happen
   measurementEvent(); //Get BMP280 Pressure data
+  Derived_weather_benchmark();
+  last_sample_millis = millis();
+  sample_stats_millis = millis();
+  sample_trend_history.push((int)roundf(SLpressure_hPa * 100));
+  sample_trend_millis = millis();
   yield();
   ReadFromSPIFFS(); //Read the previous SPIFFs
   yield();
-  UpdateSPIFFS(); //Update the SPIFFs
-  Zambretti_calc();
+  TS_begin(); //Find the end of the long term history
+  yield();
+  Rollup_seed(); //Day / week summaries from it
+  yield();
+  Boot_mark("sensor and history");
+
+  //Warm restart: everything's known already, show it now.  NTP is refreshed from loop()
+  if (rtc_restored == true)
+  {
+    UpdateSPIFFS(); //Update the SPIFFs
+    Zambretti_calc();
+    Boot_first_frame();
+  }
+
+  //The SDK has been connecting to the saved WiFi since power on.  WiFi_check() in loop() starts the services once it's
+  //on, or opens the setup portal if it doesn't get there; the lamp carries on offline meanwhile
+  WiFi_and_Credentials();
+  Boot_mark("WiFi");
 
+  pressure_read_millis = millis();
   zambretticount = millis(); //Initial count for Zambretti update
   timecount = millis();      //Initial count for NTP update
   count = millis();          //Initial count for Geiger LED update update
   working_modecount = millis();
 
-  //This requires changes to WiFiManager.cpp and WiFiManager.h
-
-  //Un-comment from WiFiManager.cpp
-  // void WiFiManager::startWPS() {
-  //   DEBUG_WM(F("START WPS"));
-  //   WiFi.beginWPSConfig();
-  //   DEBUG_WM(F("END WPS"));
-  // }
-
-  //   String WiFiManager::getSSID() {
-  //   if (_ssid == "") {
-  //     DEBUG_WM(F("Reading SSID"));
-  //     _ssid = WiFi.SSID();
-  //     DEBUG_WM(F("SSID: "));
-  //     DEBUG_WM(_ssid);
-  //   }
-  //   return _ssid;
-  //   }
-
-  //   String WiFiManager::getPassword() {
-  //   if (_pass == "") {
-  //     DEBUG_WM(F("Reading Password"));
-  //     _pass = WiFi.psk();
-  //     DEBUG_WM("Password: " + _pass);
-  //     //DEBUG_WM(_pass);
-  //   }
-  //   return _pass;
-  //   }
-
-  //Add last 2 lines into WiFiManager.h
-  // class WiFiManager
-  // {
-  //   public:
-  //     WiFiManager();
-  //     ~WiFiManager();
-
-  // 	String          getSSID();
-  // 	String          getPassword();
-
-  SpeakClock();
-    delay(1500);
-  if (working_mode == true){
-    myDFPlayer.playFolder(2, 150);
-    }
-  else
-  {
-    myDFPlayer.playFolder(2, 151);
-  }
-  
+  Boot_mark("setup done");
+
   Serial.println("");
   Serial.println("********************************************************* START LOOP **************************************************************");
   Serial.println("");
@@ -587,13 +1411,20 @@ void loop()
   // Pass gyro rate as rad/s
 
   //Handlers
-  ftpSrv.handleFTP();
-  yield();
-  ArduinoOTA.handle();
+  WiFi_check(); //WiFi setup portal, until connected
   yield();
-  checkreset(0);       //Has the GPIO (D3) been taken low to reset WiFiManager / clears SPIFFS?
-  yield();
-  Blynk.run(); //If Blynk being used
+  if (wifi_online == true)
+  {
+    ftpSrv.handleFTP();
+    yield();
+    ArduinoOTA.handle();
+    yield();
+    server.handleClient(); //Local control API
+    yield();
+    Blynk.run(); //If Blynk being used
+    yield();
+  }
+  checkreset(0);       //Has the GPIO (D3) been taken low to reset the WiFi / clear storage?
   yield();
   Timekeeping(); //Keep track ing micros() and use for calculation adjustments
   yield();
@@ -601,20 +1432,34 @@ void loop()
   yield();
   Touchsensor_check(); //Any touchs on sensor - speak the forecast
   yield();
-  update_epoch_time(); //update epoch time by millis update or NTP request
+  Pressure_sample_check(); //Read the BMP280 if due, faster while pressure is changing
   yield();
-  decode_epoch(epoch); //epoch has been updated, Now turn this into UTC clock_minutes_from_midnight
-  yield();
-  API_check();         //Check if it's time to get Sunrise/Set times and action
-  yield();
-  measurementEvent();
-
-  if (SPIFFS.exists(restartfilename) == true)
+  if (time_valid == true)
   {
-    SPIFFS.remove(restartfilename);
-    delay(5000);
-    ESP.restart();
+    update_epoch_time(); //update epoch time by millis update or NTP request
+    yield();
+    decode_epoch(epoch); //epoch has been updated, Now turn this into UTC clock_minutes_from_midnight
+    yield();
+    Sun_table_step(); //A slice of a sun table build, if one is going
+    yield();
+    if (wifi_online == true)
+    {
+      API_check(); //Check if it's time to get Sunrise/Set times and action
+      yield();
+      Geiger_check();
+      yield();
+    }
+  }
+  else if (wifi_online == true)
+  {
+    Time_boot_check(); //Waiting for the first NTP reply
   }
+  Audio_boot_check();
+  yield();
+
+  Restart_check(); //Restart / settings reload asked for (API, Blynk, FTP and PUT /file uploads)
+  Config_save_check();
+  RTC_check();
 
 
   //*** Display local time
@@ -638,9 +1483,9 @@ void loop()
 
   yield();
 
-  //*** Display Geiger / Zambretti and update LEDs
+  //*** Display Geiger / Zambretti and update LEDs.  Offline (setup portal open) they run without the clock
   delt_t = millis() - count;
-  if (delt_t > delayamount)
+  if (delt_t > delayamount && (time_valid == true || wifi_online == false))
   {
     
     if (working_mode == true ){
@@ -662,14 +1507,34 @@ void loop()
 
   yield();
 
+  //*** 5 minute pressure reading for the short history
+  if (millis() - pressure_read_millis > pressure_read_interval)
+  {
+    short_pressure_history.push((int)(SLpressure_hPa * 10 + 0.5));
+    if (time_valid == true)
+    {
+      TS_append(current_timestamp, (int)roundf(SLpressure_hPa * 10), (int)roundf(measured_temp * 10));
+      Rollup_add(current_timestamp, (int)roundf(SLpressure_hPa * 10));
+    }
+    else
+    {
+      PendingReading reading;
+      reading.read_millis = millis();
+      reading.pressure_tenths = (int)roundf(SLpressure_hPa * 10);
+      reading.temp_tenths = (int)roundf(measured_temp * 10);
+      pending_readings.push(reading); //Logged once the time is known
+    }
+    pressure_read_millis = millis();
+    Storm_check();
+  }
+
+  yield();
+
   //*** Do the Zambretti - Get data, update SPIFFs array
   delt_t = millis() - zambretticount;
-  if (delt_t > zambretti_delayamount)
+  if (delt_t > zambretti_delayamount && time_valid == true) //The log needs the time, Time_boot_check() does the first update
   {
-    measurementEvent(); //Get BMP280 Pressure data
-    yield();
-    ReadFromSPIFFS(); //Read the previous SPIFFs
-    yield();
+    //BMP280 Pressure data is kept fresh by Pressure_sample_check(), history is already in RAM (read from storage at boot)
     UpdateSPIFFS(); //Update the SPIFFs
 
     //do_blynk();
@@ -887,66 +1752,58 @@ int CalculateTrend()
   int trend; // -1 falling; 0 steady; 1 raising
   //Serial.println("---> Calculating trend");
 
-  //--> giving the most recent pressure reads more weight
-  pressure_difference[0] = (pressure_value[0] - pressure_value[1]) * 1.5;
-  pressure_difference[1] = (pressure_value[0] - pressure_value[2]);
-  pressure_difference[2] = (pressure_value[0] - pressure_value[3]) / 1.5;
-  pressure_difference[3] = (pressure_value[0] - pressure_value[4]) / 2;
-  pressure_difference[4] = (pressure_value[0] - pressure_value[5]) / 2.5;
-  pressure_difference[5] = (pressure_value[0] - pressure_value[6]) / 3;
-  pressure_difference[6] = (pressure_value[0] - pressure_value[7]) / 3.5;
-  pressure_difference[7] = (pressure_value[0] - pressure_value[8]) / 4;
-  pressure_difference[8] = (pressure_value[0] - pressure_value[9]) / 4.5;
-  pressure_difference[9] = (pressure_value[0] - pressure_value[10]) / 5;
-  pressure_difference[10] = (pressure_value[0] - pressure_value[11]) / 5.5;
-
-  //--> calculating the average and storing it into [11]
-  pressure_difference[11] = (pressure_difference[0] + pressure_difference[1] + pressure_difference[2] + pressure_difference[3] + pressure_difference[4] + pressure_difference[5] + pressure_difference[6] + pressure_difference[7] + pressure_difference[8] + pressure_difference[9] + pressure_difference[10]) / 11;
+  //--> least squares slope over the whole history, from the running sums so O(1) whatever the history length
+  //Barometric tendency is quoted per 3 hours (6 readings at 30 mins), which the thresholds below are set for
+  float slope;
+  linear_fit(pressure_history, slope, pressure_fit);
+  pressure_tendency = slope * 6;
 
   if (verbose_output == 1)
   {
     Serial.print("Current trend: ");
-    Serial.print(pressure_difference[11]);
-    Serial.print(" -->  ");
+    Serial.print(pressure_tendency);
+    Serial.print(" hPa/3h (fit ");
+    Serial.print(pressure_fit);
+    Serial.print(") -->  ");
   }
 
-  if (pressure_difference[11] > 3.5)
+  if (pressure_tendency > 3.5)
   {
     trend_in_words = TEXT_RISING_FAST;
     Zambretti_trend_mp3 = 127;
     trend = 1;
   }
-  else if (pressure_difference[11] > 1.5 && pressure_difference[11] <= 3.5)
+  else if (pressure_tendency > 1.5 && pressure_tendency <= 3.5)
   {
     trend_in_words = TEXT_RISING;
     Zambretti_trend_mp3 = 128;
     trend = 1;
   }
-  else if (pressure_difference[11] > 0.25 && pressure_difference[11] <= 1.5)
+  else if (pressure_tendency > 0.25 && pressure_tendency <= 1.5)
   {
     trend_in_words = TEXT_RISING_SLOW;
     Zambretti_trend_mp3 = 129;
     trend = 1;
   }
-  else if (pressure_difference[11] > -0.25 && pressure_difference[11] < 0.25)
+  else if (pressure_tendency > -0.25 && pressure_tendency < 0.25)
   {
     trend_in_words = TEXT_STEADY;
     Zambretti_trend_mp3 = 130;
     trend = 0;
   }
-  else if (pressure_difference[11] >= -1.5 && pressure_difference[11] < -0.25)
+  else if (pressure_tendency >= -1.5 && pressure_tendency < -0.25)
   {
     trend_in_words = TEXT_FALLING_SLOW;
     Zambretti_trend_mp3 = 131;
     trend = -1;
   }
-  else if (pressure_difference[11] >= -3.5 && pressure_difference[11] < -1.5)
+  else if (pressure_tendency >= -3.5 && pressure_tendency < -1.5)
   {
     trend_in_words = TEXT_FALLING;
     Zambretti_trend_mp3 = 132;
     trend = -1;
   }
-  else if (pressure_difference[11] <= -3.5)
+  else if (pressure_tendency <= -3.5)
   {
     trend_in_words = TEXT_FALLING_FAST;
     Zambretti_trend_mp3 = 133;
@@ -961,6 +1818,73 @@ int CalculateTrend()
   return trend;
 }
 
+//Storm early warning.  Runs on every 5min reading, so a sharp fall is flagged within minutes rather than waiting on the
+//30min Zambretti update and its 6 hours of history
+void Storm_check()
+{
+  if (short_pressure_history.size() < storm_min_readings)
+  {
+    return;
+  }
+
+  float slope, fit;
+  linear_fit(short_pressure_history, slope, fit);
+  storm_tendency = slope * 36 / 10; //36 readings per 3 hours, readings in 0.1 hPa
+
+  //Change over the last hour (12 readings), or as much as we have
+  int hour_age = min(12, short_pressure_history.size() - 1);
+  storm_hour_change = (short_pressure_history.newest() - short_pressure_history.at(hour_age)) / 10.0;
+
+  bool was_storm = storm_warning;
+
+  if (storm_hour_change <= storm_hour_drop || (storm_tendency <= storm_tendency_on && fit >= storm_fit_min))
+  {
+    storm_warning = true;
+  }
+  else if (storm_tendency > storm_tendency_off && storm_hour_change > storm_hour_drop / 2)
+  {
+    storm_warning = false;
+  }
+
+  if (storm_warning == true && was_storm == false)
+  {
+    storm_start_millis = millis();
+    Serial.println();
+    Serial.print("*** Storm warning *** ");
+    Serial.print(storm_tendency);
+    Serial.print(" hPa/3h (fit ");
+    Serial.print(fit);
+    Serial.print("), ");
+    Serial.print(storm_hour_change);
+    Serial.println(" hPa in the last hour");
+    Serial.println();
+
+    if (storm_speak == true && mp3vol > 0)
+    {
+      myDFPlayer.playFolder(2, 125); //Stormy, much rain
+    }
+  }
+
+  if (storm_warning == false && was_storm == true)
+  {
+    Serial.print("*** Storm warning cleared after ");
+    Serial.print((millis() - storm_start_millis) / 60000);
+    Serial.println(" mins ***");
+  }
+
+  if (verbose_output == 1)
+  {
+    Serial.print("Storm watch: ");
+    Serial.print(storm_tendency);
+    Serial.print(" hPa/3h (fit ");
+    Serial.print(fit);
+    Serial.print("), ");
+    Serial.print(storm_hour_change);
+    Serial.print(" hPa last hour, warning = ");
+    Serial.println(storm_warning);
+  }
+}
+
 String ZambrettiSays(char code)
 {
   Zambretti_LED = 0;
@@ -1106,6 +2030,133 @@ String ZambrettiSays(char code)
 }
 
 
+//Add a pressure reading (0.1 hPa) to the 5min, hourly and daily rollups.  Finished buckets cascade up to the next tier.
+//Only the 5min readings that go in the history, so the rollups weigh every hour the same (fast sampling doesn't count
+//more) and Rollup_seed() rebuilds them the same after a restart
+void Rollup_add(uint32_t time, int value)
+{
+  Rollup reading;
+  reading.min = value;
+  reading.max = value;
+  reading.count = 1;
+  reading.sum = value;
+  reading.start_time = time;
+
+  Rollup five_min, hour, day;
+  if (pressure_5min.add(reading, five_min))
+  {
+    if (pressure_hourly.add(five_min, hour))
+    {
+      //The hourly tier keeps one more than the week so the bucket leaving the week window can still be read
+      pressure_day.add(pressure_hourly.buckets, hour, time);
+      pressure_week.add(pressure_hourly.buckets, hour, time);
+
+      pressure_daily.add(hour, day);
+    }
+  }
+}
+
+//Merge the buckets of a tier that overlap from..to into result.  closed = false only takes the bucket being filled
+template <int N>
+void Rollup_collect(const RollupTier<N> &tier, uint32_t from, uint32_t to, Rollup &result, bool closed)
+{
+  if (closed)
+  {
+    for (int age = 0; age < tier.buckets.size(); age++)
+    {
+      const Rollup &bucket = tier.buckets.at(age);
+      if (bucket.start_time + tier.period <= from)
+      {
+        break; //Everything older is before the range
+      }
+      if (bucket.start_time < to)
+      {
+        Rollup_merge(result, bucket);
+      }
+    }
+  }
+
+  if (tier.current.count > 0 && tier.current.start_time < to && tier.current.start_time + tier.period > from)
+  {
+    Rollup_merge(result, tier.current);
+  }
+}
+
+//Min / max / mean of pressure between from and to (Unix time).  Uses the coarsest tier that fits the range so a week
+//is ~7 daily buckets, never the raw readings.  The buckets still being filled in the finer tiers are added on the end
+Rollup Rollup_query(uint32_t from, uint32_t to)
+{
+  Rollup result;
+  result.count = 0;
+  result.sum = 0;
+  result.start_time = from;
+
+  uint32_t span = to - from;
+  if (span >= 2 * 86400)
+  {
+    Rollup_collect(pressure_daily, from, to, result, true);
+    Rollup_collect(pressure_hourly, from, to, result, false);
+  }
+  else if (span >= 2 * 3600)
+  {
+    Rollup_collect(pressure_hourly, from, to, result, true);
+  }
+  else
+  {
+    Rollup_collect(pressure_5min, from, to, result, true);
+    return result;
+  }
+  Rollup_collect(pressure_5min, from, to, result, false);
+
+  return result;
+}
+
+//Sliding last 24 hours / last week from the monotonic windows, plus the buckets still being filled.  O(1) amortised
+template <int N>
+Rollup Rollup_recent(RollupWindow<N> &window)
+{
+  window.expire(pressure_hourly.buckets, current_timestamp); //Nothing may have come in for a while
+  Rollup result = window.summary();
+  Rollup_merge(result, pressure_hourly.current);
+  Rollup_merge(result, pressure_5min.current);
+  return result;
+}
+
+void Rollup_seed_reading(uint32_t time, int pressure_tenths, int temp_tenths)
+{
+  Rollup_add(time, pressure_tenths);
+}
+
+//Boot: fill the rollups from the 5min readings in the history store, so the day and week are there straight away
+void Rollup_seed()
+{
+  uint32_t start_micros = micros();
+  int blocks = TS_scan(0, Rollup_seed_reading);
+
+  Serial.print("Rollups seeded from ");
+  Serial.print(blocks);
+  Serial.print(" history blocks, took (us) ");
+  Serial.println(micros() - start_micros);
+}
+
+void Rollup_print(const char *name, const Rollup &r)
+{
+  Serial.print(name);
+  if (r.count == 0)
+  {
+    Serial.println("no data");
+    return;
+  }
+  Serial.print(r.min / 10.0f, 1);
+  Serial.print(" / ");
+  Serial.print(r.max / 10.0f, 1);
+  Serial.print(" / ");
+  Serial.print(r.sum / 10.0f / r.count, 1);
+  Serial.print(" hPa  (");
+  Serial.print(r.count);
+  Serial.println(" readings)");
+}
+
 void Pressure_handle()
 {
 
@@ -1129,6 +2180,9 @@ void Pressure_handle()
     Serial.print(" / ");
     Serial.println(maxpressure);
 
+    Rollup_print("Last 24 hours min / max / mean: ", Rollup_recent(pressure_day));
+    Rollup_print("Last week min / max / mean: ", Rollup_recent(pressure_week));
+
     Serial.println();
     Serial.println("********************************************************\n");
 
@@ -1166,15 +2220,6 @@ void Timekeeping()
 //====== Set of useful function to access acceleration. gyroscope, magnetometer, and temperature data
 //===================================================================================================================
 
-void WiFi_start()
-{
-  WiFiManager wifiManager;
-  wifiManager.autoConnect("WiFi_RubberDuck");
-
-  recovered_ssid = wifiManager.getSSID();
-  recovered_pass = wifiManager.getPassword();
-}
-
 void StartOTA()
 {
   ArduinoOTA.onStart([]() {
@@ -1188,8 +2233,9 @@ void StartOTA()
       type = "filesystem";
     }
 
-    // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
+    // NOTE: if updating the filesystem this would be the place to unmount it using LittleFS.end()
     Serial.println("Start updating " + type);
+    TS_save(); //The update ends in a restart
   });
   ArduinoOTA.onEnd([]() {
     Serial.println("\nEnd");
@@ -1309,6 +2355,14 @@ void weather_DotheLEDs()
     FastLED.setBrightness(brightness1);
   }
 
+  //Storm warning from the 5min readings overrides the forecast
+  if (storm_warning == true)
+  {
+    //Red
+    fill_solid(leds, NUM_LEDS_PER_STRIP, CRGB(255, 0, 0));
+    FastLED.setBrightness(brightness2);
+  }
+
   FastLED.show();
 
 }
@@ -1423,69 +2477,295 @@ void Touchsensor_check()
 }
 
 
-void measurementEvent()
+//Start a BMP280 forced mode conversion.  Returns false (and counts it) if the sensor didn't accept the command
+bool Sensor_start()
 {
+  char result = bmp.startMeasurment();
 
-  //Measures absolute Pressure, Temperature, Humidity, Voltage, calculate relative pressure,
-  //Dewpoint, Dewpoint Spread, Heat Index
-
+  if (result == 0)
+  {
+    sensor_failed++;
+    Serial.println("BMP280 start failed");
+    return false;
+  }
 
-  double T,P;
-  char result = bmp.startMeasurment();
+  sensor_conversion_ms = result;
+  sensor_start_millis = millis();
+  sensor_state = 1;
+  return true;
+}
 
-if(result!=0){
-    delay(result);
-    result = bmp.getTemperatureAndPressure(T,P);
-    
-      if(result!=0)
-      {
-        double A = bmp.altitude(P,P0);     
-      }
-      else {
-        Serial.println("Error.");
-      }
+//Collect the BMP280 conversion once it's had time to finish.  Returns true when a new good reading has been processed.
+//Failed or out of range reads are counted and thrown away, the last good values are kept.
+bool Sensor_collect()
+{
+  if (sensor_state != 1 || millis() - sensor_start_millis < (unsigned long)sensor_conversion_ms)
+  {
+    return false;
   }
-  else {
-    Serial.println("Error.");
+
+  sensor_state = 0;
+
+  double T, P;
+  char result = bmp.getTemperatureAndPressure(T, P);
+
+  if (result == 0 || P < sensor_min_hPa || P > sensor_max_hPa)
+  {
+    sensor_failed++;
+    Serial.print("BMP280 read rejected, failed reads = ");
+    Serial.println(sensor_failed);
+    return false;
   }
 
   // Get temperature
   measured_temp = T;
 
-  // Get pressure
-  measured_pres = P;
-  pressure = P;
+  // Get pressure, through the pre-filter
+  measured_pres = Pressure_filter(P);
+  pressure = measured_pres;
+
+  measurementEvent_calc();
+  return true;
+}
+
+//Pre-filter for the raw pressure.  0 = none, 1 = IIR (latency about (1-alpha)/alpha samples), 2 = median of 3 (latency 1 sample)
+float Pressure_filter(float raw)
+{
+  if (pressure_filter_count == 0)
+  {
+    //First reading, start the filter here rather than ramping up from 0
+    pressure_iir = raw;
+    pressure_median[0] = pressure_median[1] = pressure_median[2] = raw;
+  }
+  pressure_filter_count++;
+
+  pressure_median[pressure_filter_count % 3] = raw;
+  pressure_iir = pressure_iir + pressure_iir_alpha * (raw - pressure_iir);
+
+  if (pressure_filter == 1)
+  {
+    return pressure_iir;
+  }
+
+  if (pressure_filter == 2)
+  {
+    float a = pressure_median[0], b = pressure_median[1], c = pressure_median[2];
+    return max(min(a, b), min(max(a, b), c));
+  }
+
+  return raw;
+}
+
+//Filter latency in samples, used to report how far behind the filtered pressure is
+float Pressure_filter_latency()
+{
+  if (pressure_filter == 1)
+  {
+    return (1 - pressure_iir_alpha) / pressure_iir_alpha;
+  }
+
+  if (pressure_filter == 2)
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+//Blocking read, only for setup() when we need a value before going on.  loop() uses Pressure_sample_check()
+void measurementEvent()
+{
+  if (Sensor_start())
+  {
+    delay(sensor_conversion_ms);
+    Sensor_collect();
+  }
+}
+
+void measurementEvent_calc()
+{
+  uint32_t start_cycles = ESP.getCycleCount();
+
+  //Calculate relative pressure.  The elevation part never changes so it's SLpressure_factor, worked out once
+  SLpressure_hPa = measured_pres * SLpressure_factor;
+  rel_pressure_rounded = (int)(SLpressure_hPa + 0.5f);
+
+  //Dewpoint, spread and heat index are left until something asks for them
+  derived_weather_valid = false;
 
-  // Calculate and print relative pressure
-  SLpressure_hPa = (((measured_pres * 100.0)/pow((1-((float)(ELEVATION))/44330), 5.255))/100.0);
-  rel_pressure_rounded=(int)(SLpressure_hPa+.5);
+  calc_cycles = ESP.getCycleCount() - start_cycles;
+} // end of void measurementEvent_calc()
+
+//Dewpoint, Dewpoint Spread, Heat Index from the last reading.  Only worked out when asked for and the reading has changed.
+//No FPU on the ESP8266 so all single precision
+void Derived_weather()
+{
+  if (derived_weather_valid == true)
+  {
+    return;
+  }
+
+  uint32_t start_cycles = ESP.getCycleCount();
 
   // Calculate dewpoint
-  double a = 17.271;
-  double b = 237.7;
-  double tempcalc = (a * measured_temp) / (b + measured_temp) + log(measured_humi * 0.01);
+  const float a = 17.271f;
+  const float b = 237.7f;
+  float tempcalc = (a * measured_temp) / (b + measured_temp) + logf(measured_humi * 0.01f);
   DewpointTemperature = (b * tempcalc) / (a - tempcalc);
 
   // Calculate dewpoint spread (difference between actual temp and dewpoint -> the smaller the number: rain or fog
   DewPointSpread = measured_temp - DewpointTemperature;
 
   // Calculate HI (heatindex in °C) --> HI starts working above 26,7 °C
-  if (measured_temp > 26.7)
+  if (measured_temp > 26.7f)
   {
-    double c1 = -8.784, c2 = 1.611, c3 = 2.338, c4 = -0.146, c5 = -1.230e-2, c6 = -1.642e-2, c7 = 2.211e-3, c8 = 7.254e-4, c9 = -2.582e-6;
-    double T = measured_temp;
-    double R = measured_humi;
+    const float c1 = -8.784f, c2 = 1.611f, c3 = 2.338f, c4 = -0.146f, c5 = -1.230e-2f, c6 = -1.642e-2f, c7 = 2.211e-3f, c8 = 7.254e-4f, c9 = -2.582e-6f;
+    float T = measured_temp;
+    float R = measured_humi;
 
-    double A = ((c5 * T) + c2) * T + c1;
-    double B = ((c7 * T) + c4) * T + c3;
-    double C = ((c9 * T) + c8) * T + c6;
+    float A = ((c5 * T) + c2) * T + c1;
+    float B = ((c7 * T) + c4) * T + c3;
+    float C = ((c9 * T) + c8) * T + c6;
     HeatIndex = (C * R + B) * R + A;
   }
   else
   {
     HeatIndex = measured_temp;
   }
-} // end of void measurementEvent()
+
+  derived_weather_valid = true;
+  derived_cycles = ESP.getCycleCount() - start_cycles;
+}
+
+//Boot: cycles for the old way (double precision and the elevation pow() on every reading) against measurementEvent_calc()
+//plus Derived_weather().  Fixed inputs (28C so the heat index runs, 60%) as the BMP280 has no humidity
+void Derived_weather_benchmark()
+{
+  //volatile so the compiler can't work any of it out at build time, the old code did the pow() on every reading
+  volatile double pres = measured_pres, temp = 28.0, humi = 60.0;
+  volatile float elevation = ELEVATION;
+
+  uint32_t start_cycles = ESP.getCycleCount();
+  double SL_pressure = (((pres * 100.0) / pow((1 - elevation / 44330), 5.255)) / 100.0);
+  double a = 17.271;
+  double b = 237.7;
+  double tempcalc = (a * temp) / (b + temp) + log(humi * 0.01);
+  double dewpoint = (b * tempcalc) / (a - tempcalc);
+  double c1 = -8.784, c2 = 1.611, c3 = 2.338, c4 = -0.146, c5 = -1.230e-2, c6 = -1.642e-2, c7 = 2.211e-3, c8 = 7.254e-4, c9 = -2.582e-6;
+  double A = ((c5 * temp) + c2) * temp + c1;
+  double B = ((c7 * temp) + c4) * temp + c3;
+  double C = ((c9 * temp) + c8) * temp + c6;
+  volatile double heat_index = (C * humi + B) * humi + A + dewpoint + SL_pressure;
+  uint32_t double_cycles = ESP.getCycleCount() - start_cycles;
+  (void)heat_index;
+
+  float saved_temp = measured_temp, saved_humi = measured_humi;
+  measured_temp = 28.0f;
+  measured_humi = 60.0f;
+  measurementEvent_calc();
+  Derived_weather();
+  measured_temp = saved_temp;
+  measured_humi = saved_humi;
+  derived_weather_valid = false;
+
+  Serial.print("Weather maths cycles, double every reading: ");
+  Serial.print(double_cycles);
+  Serial.print(",   float: ");
+  Serial.print(calc_cycles);
+  Serial.print(" + ");
+  Serial.print(derived_cycles);
+  Serial.println(" when asked for");
+}
+
+//Decide if it's time to read the BMP280.  Slow while the pressure is steady, fast while the 30min trend is over
+//sample_fast_rate.  Samples per hour and sensor power are reported once an hour.
+//The read is split over loops (start, then collect when the conversion is done) so loop() never waits on the sensor
+void Pressure_sample_check()
+{
+  if (sensor_state == 0 && millis() - last_sample_millis >= sample_interval)
+  {
+    last_sample_millis = millis();
+    if (Sensor_start())
+    {
+      samples_count++;
+      sensor_busy_ms += sensor_conversion_ms;
+    }
+  }
+
+  if (Sensor_collect())
+  {
+    //The trend is a straight line through the last 30mins, so one noisy read can't move it.  About 1 reading a minute
+    //goes in (a little under, so slow reads a minute apart all count)
+    if (millis() - sample_trend_millis >= 55000)
+    {
+      sample_trend_history.push((int)roundf(SLpressure_hPa * 100));
+      sample_trend_millis = millis();
+    }
+
+    float slope, fit;
+    linear_fit(sample_trend_history, slope, fit);
+    sample_trend_rate = slope * 60 / 100; //Per minute reading in 0.01 hPa to hPa per hour
+
+    if (sample_trend_history.size() >= sample_trend_min && abs(sample_trend_rate) > sample_fast_rate)
+    {
+      if (sample_interval != sample_fast_interval)
+      {
+        Serial.print("Pressure changing ");
+        Serial.print(sample_trend_rate);
+        Serial.println(" hPa/h, fast sampling");
+      }
+      sample_interval = sample_fast_interval;
+      fast_sample_millis = millis();
+    }
+    else if (sample_interval == sample_fast_interval && millis() - fast_sample_millis > sample_fast_hold)
+    {
+      Serial.println("Pressure steady, slow sampling");
+      sample_interval = sample_slow_interval;
+    }
+  }
+
+  //Hourly report
+  if (millis() - sample_stats_millis >= 3600000)
+  {
+    float hours = (millis() - sample_stats_millis) / 3600000.0f;
+    float average_uA = sensor_measure_uA * sensor_busy_ms / (hours * 3600000.0f) + 0.1f;
+
+    Serial.print("Pressure samples/hour: ");
+    Serial.print(samples_count / hours);
+    Serial.print(",   BMP280 busy ms/hour: ");
+    Serial.print(sensor_busy_ms / hours);
+    Serial.print(",   BMP280 average uA: ");
+    Serial.print(average_uA);
+    Serial.print(",   sample interval (s): ");
+    Serial.print(sample_interval / 1000);
+    Serial.print(",   filter latency (s): ");
+    Serial.print(Pressure_filter_latency() * sample_interval / 1000);
+    Serial.print(",   failed reads: ");
+    Serial.print(sensor_failed);
+    Serial.print(",   calc cycles: ");
+    Serial.print(calc_cycles);
+    Serial.print(",   derived cycles: ");
+    Serial.print(derived_cycles);
+    if (measured_humi > 0) //Only with a humidity sensor, the BMP280 hasn't got one
+    {
+      Derived_weather();
+      Serial.print(",   dewpoint: ");
+      Serial.print(DewpointTemperature);
+      Serial.print(",   dewpoint spread: ");
+      Serial.print(DewPointSpread);
+      Serial.print(",   heat index: ");
+      Serial.print(HeatIndex);
+    }
+    Serial.print(",   history append (us): ");
+    Serial.print(ts_append_micros);
+    Serial.print(",   storm watch latency (s) < ");
+    Serial.println((pressure_read_interval + sample_interval) / 1000);
+
+    samples_count = 0;
+    sensor_busy_ms = 0;
+    sample_stats_millis = millis();
+  }
+}
 
 void UpdateSPIFFS()
 {
@@ -1500,12 +2780,7 @@ void UpdateSPIFFS()
   else if (current_timestamp - saved_timestamp > 1800)
   { // it is time for pressure update (1800 sec = 30 min)
 
-    for (int i = 11; i >= 1; i = i - 1)
-    {
-      pressure_value[i] = pressure_value[i - 1]; // shifting values one to the right
-    }
-
-    pressure_value[0] = rel_pressure_rounded; // updating with acutal rel pressure (newest value)
+    pressure_history.push(rel_pressure_rounded); // updating with acutal rel pressure (newest value), oldest drops off
 
     if (accuracy < 12)
     {
@@ -1514,1248 +2789,3538 @@ void UpdateSPIFFS()
     WriteToSPIFFS(current_timestamp); // update timestamp on storage
     Serial.println("writing current_timestamp");
   }
-  else
-  {
-    WriteToSPIFFS(saved_timestamp); // do not update timestamp on storage
-    Serial.println("writing saved_timestamp");
-  }
+  //else nothing has changed, nothing to write
 }
 
 void FirstTimeRun()
 {
   Serial.println("---> Starting initializing process.");
   accuracy = 1;
-  char filename[] = "/data.txt";
-  File myDataFile = SPIFFS.open(filename, "w"); // Open a file for writing
-  if (!myDataFile)
+
+  //Filling pressure array with current pressure
+  pressure_history.clear();
+  for (int i = 0; i < 12; i++)
   {
-    Serial.println("Failed to open file");
-    Serial.println("Stopping process - maybe flash size not set (SPIFFS).");
-    exit(0);
+    pressure_history.push(rel_pressure_rounded);
   }
-  myDataFile.println(current_timestamp); // Saving timestamp to /data.txt
+  saved_timestamp = current_timestamp;
+
   Serial.print("*!* current_timestamp = ");
   Serial.println(current_timestamp);
 
-  myDataFile.println(accuracy); // Saving accuracy value to /data.txt
-  for (int i = 0; i < 12; i++)
-  {
-    myDataFile.println(rel_pressure_rounded); // Filling pressure array with current pressure
-  }
+  Log_append(LOG_RECORD_RESET, current_timestamp, rel_pressure_rounded);
   Serial.println("** Saved initial pressure data. **");
-  myDataFile.close();
 }
 
-void ReadFromSPIFFS()
+//CRC-32 (same polynomial as zip), bit at a time to keep flash use down.  Only run over a few bytes at a time
+uint32_t crc32_calc(const uint8_t *data, size_t length, uint32_t crc)
 {
-  char filename[] = "/data.txt";
-  File myDataFile = SPIFFS.open(filename, "r"); // Open file for reading
-  if (!myDataFile)
+  crc = ~crc;
+  while (length--)
   {
-    Serial.println("Failed to open file");
-    FirstTimeRun(); // no file there -> initializing
+    crc ^= *data++;
+    for (int k = 0; k < 8; k++)
+    {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
   }
+  return ~crc;
+}
 
-  Serial.println("---> Now reading from SPIFFS");
-
-  String temp_data;
-
-  temp_data = myDataFile.readStringUntil('\n');
-  saved_timestamp = temp_data.toInt();
-  Serial.print("Timestamp from SPIFFS: ");
-  Serial.println(saved_timestamp);
-
-  temp_data = myDataFile.readStringUntil('\n');
-  accuracy = temp_data.toInt();
-  Serial.print("Accuracy value read from SPIFFS: ");
-  Serial.println(accuracy);
+//Read and check a log file.  Returns true if the header is good and the full snapshot is there.
+//records = number of good records, torn = true if there are bytes after the last good record (interrupted append)
+bool Log_check(const char *filename, uint32_t &sequence, int &records, bool &torn)
+{
+  records = 0;
+  torn = false;
 
-  Serial.print("Last 12 saved pressure values: ");
-  for (int i = 0; i <= 11; i++)
+  if (!Storage.exists(filename))
   {
-    temp_data = myDataFile.readStringUntil('\n');
-    pressure_value[i] = temp_data.toInt();
-    Serial.print(pressure_value[i]);
-    Serial.print("; ");
+    return false;
   }
-  myDataFile.close();
-  Serial.println();
-}
 
-void WriteToSPIFFS(int write_timestamp)
-{
-  char filename[] = "/data.txt";
-  File myDataFile = SPIFFS.open(filename, "w"); // Open file for writing (appending)
-  if (!myDataFile)
+  File logfile = Storage.open(filename, "r");
+  if (!logfile)
   {
-    Serial.println("Failed to open file");
+    return false;
   }
 
-  Serial.println("---> Now writing to SPIFFS");
-
-  myDataFile.println(write_timestamp); // Saving timestamp to /data.txt
-  myDataFile.println(accuracy);        // Saving accuracy value to /data.txt
+  LogHeader header;
+  if (logfile.read((uint8_t *)&header, sizeof(header)) != sizeof(header) || header.magic != LOG_MAGIC || header.version != LOG_VERSION ||
+      header.record_size != sizeof(LogRecord) || header.crc != crc32_calc((const uint8_t *)&header, sizeof(header) - 4))
+  {
+    logfile.close();
+    return false;
+  }
+  sequence = header.sequence;
 
-  for (int i = 0; i <= 11; i++)
+  LogRecord record;
+  while (logfile.read((uint8_t *)&record, sizeof(record)) == sizeof(record))
   {
-    myDataFile.println(pressure_value[i]); // Filling pressure array with updated values
+    if (record.crc != crc32_calc((const uint8_t *)&record, sizeof(record) - 4))
+    {
+      torn = true;
+      break;
+    }
+    records++;
   }
-  myDataFile.close();
 
-  Serial.println("File written. Now reading file again.");
-  myDataFile = SPIFFS.open(filename, "r"); // Open file for reading
-  Serial.print("Found in /data.txt = ");
-  while (myDataFile.available())
+  if (logfile.available() > 0)
   {
-    Serial.print(myDataFile.readStringUntil('\n'));
-    Serial.print("; ");
+    torn = true;
   }
-  Serial.println();
-  myDataFile.close();
+  logfile.close();
+
+  return records >= (int)header.snapshot_records;
 }
 
-void do_blynk()
+//Replay a checked log file into pressure_history / accuracy / saved_timestamp
+void Log_replay(const char *filename)
 {
-  //**************************Sending Data to Blynk and ThingSpeak*********************************
-  // code block for uploading data to BLYNK App
+  File logfile = Storage.open(filename, "r");
+  LogHeader header;
+  logfile.read((uint8_t *)&header, sizeof(header));
 
-  // if (App1 == "BLYNK") {
-  //  Blynk.virtualWrite(0, measured_temp);            // virtual pin 0
-  //  Blynk.virtualWrite(1, measured_humi);            // virtual pin 1
-  Blynk.virtualWrite(2, measured_pres);        // virtual pin 2
-  Blynk.virtualWrite(3, rel_pressure_rounded); // virtual pin 3
-  Blynk.virtualWrite(7, ZambrettisWords);      // virtual pin 7
-  Blynk.virtualWrite(8, accuracy_in_percent);  // virtual pin 8
+  LogRecord record;
+  while (logfile.read((uint8_t *)&record, sizeof(record)) == sizeof(record) && record.crc == crc32_calc((const uint8_t *)&record, sizeof(record) - 4))
+  {
+    if (record.type == LOG_RECORD_RESET)
+    {
+      pressure_history.clear();
+      for (int i = 0; i < 12; i++)
+      {
+        pressure_history.push(record.pressure);
+      }
+    }
+    else
+    {
+      pressure_history.push(record.pressure);
+    }
+    accuracy = record.accuracy;
+    saved_timestamp = record.timestamp;
+  }
+  logfile.close();
+}
 
-  if (accuracy < accuracygate)
+//Append one record to the active log.  Compacts into the other A/B file once the log gets long
+void Log_append(uint8_t type, uint32_t timestamp, int value)
+{
+  if (log_active < 0 || log_records >= log_compact_records)
   {
-    Blynk.virtualWrite(9, "No trend"); // virtual pin 9
+    Log_compact();
+    return; //The snapshot already holds this record
   }
-  else
+
+  LogRecord record;
+  record.timestamp = timestamp;
+  record.pressure = value;
+  record.accuracy = accuracy;
+  record.type = type;
+  record.crc = crc32_calc((const uint8_t *)&record, sizeof(record) - 4);
+
+  File logfile = Storage.open(log_filenames[log_active], "a");
+  if (!logfile)
   {
-    Blynk.virtualWrite(9, trend_in_words); // virtual pin 9
+    Serial.println("Failed to open pressure log");
+    return;
   }
+  logfile.write((const uint8_t *)&record, sizeof(record));
+  logfile.close();
+  log_records++;
 }
 
-void SPIFFS_init()
+//Write the current state as a fresh log in the other A/B file.  Until its snapshot is complete the old file is still
+//the good one, so power loss part way through loses nothing.  The old file is removed once the new one is committed
+void Log_compact()
 {
-  //*****************Checking if SPIFFS available********************************
-  Serial.println("SPIFFS Initialization: (First time run can last up to 30 sec - be patient)");
+  int next = (log_active == 0) ? 1 : 0;
+
+  LogHeader header;
+  header.magic = LOG_MAGIC;
+  header.version = LOG_VERSION;
+  header.record_size = sizeof(LogRecord);
+  header.snapshot_records = 12;
+  header.sequence = log_sequence + 1;
+  header.crc = crc32_calc((const uint8_t *)&header, sizeof(header) - 4);
+
+  File logfile = Storage.open(log_filenames[next], "w");
+  if (!logfile)
+  {
+    Serial.println("Failed to open pressure log");
+    return;
+  }
+  logfile.write((const uint8_t *)&header, sizeof(header));
 
-  boolean mounted = SPIFFS.begin(); // load config if it exists. Otherwise use defaults.
-  if (!mounted)
+  //Snapshot: reset to the oldest value then the other 11, oldest first.  Replays to exactly the current history
+  LogRecord records[12];
+  for (int i = 0; i < 12; i++)
   {
-    Serial.println("FS not formatted. Doing that now... (can last up to 30 sec).");
-    SPIFFS.format();
-    Serial.println("FS formatted...");
-    Serial.println("");
-    SPIFFS.begin();
+    records[i].timestamp = saved_timestamp;
+    records[i].pressure = pressure_history.at(11 - i);
+    records[i].accuracy = accuracy;
+    records[i].type = (i == 0) ? LOG_RECORD_RESET : LOG_RECORD_SAMPLE;
+    records[i].crc = crc32_calc((const uint8_t *)&records[i], sizeof(LogRecord) - 4);
+  }
+  logfile.write((const uint8_t *)records, sizeof(records));
+  logfile.close();
+
+  if (log_active >= 0)
+  {
+    Storage.remove(log_filenames[log_active]);
   }
+
+  log_active = next;
+  log_sequence = header.sequence;
+  log_records = 12;
 }
 
-void update_epoch_time()
+//Boot time read of the pressure log.  Picks the newest good A/B file, or moves an old /data.txt over, or starts fresh
+void ReadFromSPIFFS()
 {
-  //update current time with millis
-  current_timestamp = millis_unix_timestamp_baseline + ((millis() - millis_unix_timestamp) / 1000);
+  Serial.println("---> Now reading from storage");
 
-  epoch = epochstart + (((millis() - startmillis) / 1000) * timefactor); //Get epoch from millis count.  May get over writtem by NTP pull.  timefactor is for testing to accellerate time for testing
-  printNTP = 0;                                                          //Flag to state time was not from an NTP request.
+  uint32_t sequence[2] = {0, 0};
+  int records[2] = {0, 0};
+  bool torn[2] = {false, false};
+  bool good[2];
 
-  //Update the time.  NTP pull is only done periodically based on NTP_Seconds_to_wait, we count millis (pretty accurate) when not getting NTP time
-  Seconds_SinceLast_NTP_millis = (millis() - Last_NTP_millis) / 1000; //How many seconds since Last_NTP_millis pull
+  for (int slot = 0; slot < 2; slot++)
+  {
+    good[slot] = Log_check(log_filenames[slot], sequence[slot], records[slot], torn[slot]);
+  }
 
-  if (Seconds_SinceLast_NTP_millis > NTP_Seconds_to_wait) //Don't go to NTP during flash phase as it causes flicker
+  log_active = -1;
+  if (good[0] && (!good[1] || sequence[0] > sequence[1]))
   {
-    if (verbose_output == 1)
+    log_active = 0;
+  }
+  else if (good[1])
+  {
+    log_active = 1;
+  }
+
+  if (log_active >= 0)
+  {
+    Log_replay(log_filenames[log_active]);
+    log_sequence = sequence[log_active];
+    log_records = records[log_active];
+
+    //Tidy up an old file left by a power cut, and move past a torn append so new records can be read back
+    int other = (log_active == 0) ? 1 : 0;
+    if (Storage.exists(log_filenames[other]))
     {
-      Serial.print("millis = ");
-      Serial.println(millis());
-      Serial.print("start millis = ");
-      Serial.println(startmillis);
-      Serial.print("epochstart = ");
-      Serial.println(epochstart);
-      Serial.print("epoch = ");
-      Serial.println(epoch);
-      Serial.println("");
+      Storage.remove(log_filenames[other]);
     }
+    if (torn[log_active])
+    {
+      Serial.println("Pressure log has a torn record, compacting");
+      Log_compact();
+    }
+  }
+  else if (Storage.exists("/data.txt"))
+  {
+    ReadFromSPIFFS_text();
+    Log_compact();
+    Storage.remove("/data.txt");
+    Serial.println("Moved /data.txt to the binary pressure log");
+  }
+  else
+  {
+    Serial.println("No pressure log");
+    FirstTimeRun(); // no file there -> initializing
+    return;
+  }
 
-    Request_Time(); //Get the timedata
-    printNTP = 1;   //1 is a flag to serialprint the time (only used for NTP pull not for millis updates)
-    delay(2000);
-    NTPdelaycounter++; //Count how many delay functions after request time
+  Serial.print("Timestamp from storage: ");
+  Serial.println(saved_timestamp);
+  Serial.print("Accuracy value read from storage: ");
+  Serial.println(accuracy);
+  Serial.print("Last 12 saved pressure values: ");
+  for (int i = 0; i <= 11; i++)
+  {
+    Serial.print(pressure_history.at(i));
+    Serial.print("; ");
+  }
+  Serial.println();
+}
 
-    while (!Check_Time()) //Converts to Epoch, returns a False if not data Rxd
-    {                     //If no time recieved then do this
-      delay(2000);
-      Serial.println("No packets, NTP Wait...");
-      NTPdelaycounter++; //+1 for another delay
-      TimeCheckLoop++;
+//Old text format /data.txt, only read once to move it to the binary log
+void ReadFromSPIFFS_text()
+{
+  File myDataFile = Storage.open("/data.txt", "r"); // Open file for reading
 
-      //If after 5 tries, Give up and exit the NTP function, reset the loop counter.  epoch already updated from Millis()
-      if (TimeCheckLoop >= 5)
-      {
-        TimeCheckLoop = 0;
-        NTPdelaycounter = 0; //Reset counter on exit
-        break;
-      }
-      else if (TimeCheckLoop > 2)
-      {
-        //If after 2 tried then try re-requesting the time
-        retryNTP += 1; //Update the counter for informational only, not used in the program
-        Request_Time();
-      }
-    }
+  String temp_data;
 
-    NTPdelaycounter = 0; //Time recieved, reset counter
+  temp_data = myDataFile.readStringUntil('\n');
+  saved_timestamp = temp_data.toInt();
 
-    //Time confirmed received and more than wait period to pull NTP / Sunrise time
-    Last_NTP_millis = millis(); //Set the Last_NTP_millis time to now - resets the wait time
+  temp_data = myDataFile.readStringUntil('\n');
+  accuracy = temp_data.toInt();
 
-    if (verbose_output == 1)
-    {
-      Serial.println();
-      Serial.println("********************************************************");
-      Serial.println();
-    }
+  //File holds newest first, push oldest first so the newest ends up at(0)
+  int saved_pressure[12];
+  for (int i = 0; i <= 11; i++)
+  {
+    temp_data = myDataFile.readStringUntil('\n');
+    saved_pressure[i] = temp_data.toInt();
+  }
 
-    yield();
-    NTP_Seconds_to_wait = NTPSecondstowait; //Over write the initial wait period (1 sec) to the ongoing period (e.g 600 sec)
+  pressure_history.clear();
+  for (int i = 11; i >= 0; i--)
+  {
+    pressure_history.push(saved_pressure[i]);
   }
-  current_timestamp = epoch;
+  myDataFile.close();
 }
 
-void initiate_time()
+void WriteToSPIFFS(uint32_t write_timestamp)
 {
-  //Initiate time
-  udp.begin(localPort);
-  Serial.print("Local port: ");
-  Serial.println(udp.localPort());
+  uint32_t start_micros = micros();
 
-  NTPdelaycounter = 0; //Reset counter on exit
-  Request_Time();      //Get the time
-  delay(2000);
-  NTPdelaycounter++; //Add 1 to delay counter
+  saved_timestamp = write_timestamp;
+  Log_append(LOG_RECORD_SAMPLE, write_timestamp, pressure_history.newest());
+
+  Serial.print("Pressure log write (us): ");
+  Serial.println(micros() - start_micros);
+}
 
-  while (!Check_Time())
-  { //If no time recieved then do this
-    delay(2000);
-    TimeCheckLoop++;
-    NTPdelaycounter++;
+//***************************************************************************************************
+//History store.  Gorilla style compression of 5min pressure and temperature into fixed size blocks:
+//timestamps as delta of delta, values as XOR with the previous value.  One block is buffered in RAM,
+//full blocks go into the reserved history flash which is used as a circular list of TS_BLOCKS blocks
+//***************************************************************************************************
 
-    if (TimeCheckLoop > 5)
-    {                      //If not time received even after 5x 2sec delays, then try re-getting time
-      Request_Time();      //Get the time
-      NTPdelaycounter = 0; //Reset delay counter on new request
+void TS_put_bits(uint32_t value, int bits)
+{
+  while (bits-- > 0)
+  {
+    if ((value >> bits) & 1)
+    {
+      ts_block.payload[ts_writer.bit >> 3] |= 0x80 >> (ts_writer.bit & 7);
     }
+    ts_writer.bit++;
   }
-
-  NTPdelaycounter = 0;    //Reset delay counter on exit
-  epochstart = epoch;     //epoch pulled from NTP server, use initial epoch to set starting point for epochmillis
-  startmillis = millis(); //get starting point for millis
-  current_timestamp = epoch;
 }
 
-//Get time from NTP Server
-void Request_Time()
+//Reads with 32 bit loads only (byte n is bits 8n.. of its little endian word) so the payload can be in mapped flash
+uint32_t TS_get_bits(const uint32_t *payload, TSState &state, int bits)
 {
-  Serial.println("Getting Time");
-  WiFi.hostByName(NTPServerName, timeServer);
-  sendNTPpacket(timeServer); // send an NTP packet to a time server
+  uint32_t value = 0;
+  while (bits-- > 0)
+  {
+    uint32_t byte = payload[state.bit >> 5] >> (8 * ((state.bit >> 3) & 3));
+    value = (value << 1) | ((byte >> (7 - (state.bit & 7))) & 1);
+    state.bit++;
+  }
+  return value;
 }
 
-//This returns a bool value based on UDP time being received and placed in epoch variable
-bool Check_Time()
+int TS_leading_zeros(uint32_t x)
 {
-  bool ret_val = false;
-
-  // //Test only:  Simulate NTP packets not Rxd
-  // srand (millis());
+  int n = 0;
+  while (n < 32 && !(x & 0x80000000))
+  {
+    x <<= 1;
+    n++;
+  }
+  return n;
+}
 
-  // int blah=rand() % 100;
-  // Serial.print("RAND = ");
-  // Serial.println(blah);
+int TS_trailing_zeros(uint32_t x)
+{
+  int n = 0;
+  while (n < 32 && !(x & 1))
+  {
+    x >>= 1;
+    n++;
+  }
+  return n;
+}
 
-  // if (blah >= 80){
-  //   return ret_val;
-  // }
+void TS_put_value(int series, uint32_t value)
+{
+  uint32_t x = value ^ ts_writer.value[series];
+  ts_writer.value[series] = value;
 
-  //Clear the buffer, keep looping and pulling packets until no more NTP packets are available.
-  //Put here in scenario that if multiple retires to NTP then multiple packets eventually Rxd, this clears them all and takes the latest
-  for (int cb = udp.parsePacket(); cb > 0; cb = udp.parsePacket())
+  if (x == 0)
   {
+    TS_put_bits(0, 1); //'0' same as last time
+    return;
+  }
 
-    Serial.print("packet received, length=");
-    Serial.println(cb);
-    Serial.println();
-    Serial.println("****************");
-    Serial.println();
-
-    // We've received a packet, read the data from it
-    udp.read(packetBuffer, NTP_PACKET_SIZE); // read the packet into the buffer
+  int leading = TS_leading_zeros(x);
+  int trailing = TS_trailing_zeros(x);
+  if (leading > 31)
+  {
+    leading = 31;
+  }
 
-    //the timestamp starts at byte 40 of the received packet and is four bytes,
-    // or two words, long. First, extract the two words:
-
-    unsigned long highWord = word(packetBuffer[40], packetBuffer[41]);
-    unsigned long lowWord = word(packetBuffer[42], packetBuffer[43]);
-    // combine the four bytes (two words) into a long integer
-    // this is NTP time (seconds since Jan 1 1900):
-    unsigned long secsSince1900 = highWord << 16 | lowWord;
-    //Serial.print("Seconds since Jan 1 1900 = " );
-    // Serial.println(secsSince1900);
-
-    // now convert NTP time into everyday time:
-    //Serial.print("Unix time = ");
-    // Unix time starts on Jan 1 1970. In seconds, that's 2208988800:
-    const unsigned long seventyYears = 2208988800UL;
-    lastepoch = epoch; //Used to compare last known epoch time with new NTP
+  int prev_leading = ts_writer.leading[series];
+  int prev_meaningful = ts_writer.meaningful[series];
 
-    // subtract seventy years:
-    epoch = secsSince1900 - seventyYears;
+  if (prev_meaningful > 0 && leading >= prev_leading && trailing >= 32 - prev_leading - prev_meaningful)
+  {
+    //'10' fits in the last window of meaningful bits
+    TS_put_bits(2, 2);
+    TS_put_bits(x >> (32 - prev_leading - prev_meaningful), prev_meaningful);
+  }
+  else
+  {
+    //'11' new window: 5 bits leading zeros, 5 bits (meaningful - 1), then the meaningful bits
+    int meaningful = 32 - leading - trailing;
+    TS_put_bits(3, 2);
+    TS_put_bits(leading, 5);
+    TS_put_bits(meaningful - 1, 5);
+    TS_put_bits(x >> trailing, meaningful);
+    ts_writer.leading[series] = leading;
+    ts_writer.meaningful[series] = meaningful;
+  }
+}
 
-    //Add seconds to factor for delay(2000)
-    epoch = epoch + (2 * NTPdelaycounter);
+uint32_t TS_get_value(const uint32_t *payload, TSState &state, int series)
+{
+  if (TS_get_bits(payload, state, 1) == 0)
+  {
+    return state.value[series];
+  }
 
-    //Check if there are lost packets (epoch is wildly different from last time).  If yes, use last epoch
-    //if first epoch time is wrong this is constantly fail.
+  if (TS_get_bits(payload, state, 1) == 1)
+  {
+    state.leading[series] = TS_get_bits(payload, state, 5);
+    state.meaningful[series] = TS_get_bits(payload, state, 5) + 1;
+  }
 
-    Serial.print("secsSince1900: ");
-    Serial.print(secsSince1900);
-    Serial.print(",  epoch: ");
-    Serial.println(epoch);
+  int shift = 32 - state.leading[series] - state.meaningful[series];
+  uint32_t x = TS_get_bits(payload, state, state.meaningful[series]) << shift;
+  state.value[series] ^= x;
+  return state.value[series];
+}
 
-    if (abs(epoch - lastepoch) > 3600 && lastepoch != 0) //Check if the old and new epoch times are more than 60s x 60 (1hr) and lastepoch isn't 0 (not had a time before)
-    {
-      Serial.println("epoch vs oldepoch > 1hr");
-      if (lastepochcount <= 3)
-      {
-        epoch = lastepoch; //If more than 1hr difference, and old/new different less than 'N' times
-        lastepochcount = lastepochcount + 1;
-        totalfailepoch = totalfailepoch + 1;
+void TS_put_time(uint32_t time)
+{
+  int32_t delta = time - ts_writer.time;
+  int32_t dod = delta - ts_writer.delta;
+  ts_writer.time = time;
+  ts_writer.delta = delta;
 
-        Serial.println("Using oldepoch from millis");
-        Serial.print("previously failed = ");
-        Serial.println(totalfailepoch);
-        Serial.println();
-      }
-      else
-      {
-        lastepochcount = 0; //It's different more than 'N' times, inital NTP must have been wrong.  Stay with last recieved epoch.
-        lastepoch = epoch;
-        Serial.println("Using new epoch even though different.  It's been different too many times - resetting");
-        Serial.print("previously failed = ");
-        Serial.print(totalfailepoch);
-        Serial.println(",  Making internal clock = new NTP time");
-        Serial.println();
+  if (dod == 0)
+  {
+    TS_put_bits(0, 1);
+  }
+  else if (dod >= -63 && dod <= 64)
+  {
+    TS_put_bits(2, 2);
+    TS_put_bits(dod + 63, 7);
+  }
+  else if (dod >= -255 && dod <= 256)
+  {
+    TS_put_bits(6, 3);
+    TS_put_bits(dod + 255, 9);
+  }
+  else if (dod >= -2047 && dod <= 2048)
+  {
+    TS_put_bits(14, 4);
+    TS_put_bits(dod + 2047, 12);
+  }
+  else
+  {
+    TS_put_bits(15, 4);
+    TS_put_bits(dod, 32);
+  }
+}
 
-        epochstart = epoch;     //Using NTP epoch time.  Reset the millis time variables to use this as new starting point
-        startmillis = millis(); //Using NTP epoch time.  Reset the millis time variables to use this as new starting point
-      }
-    }
-    else
-    {
-      Serial.print("epoch is good");
-      Serial.print(",   previously failed = ");
-      Serial.println(totalfailepoch);
-      Serial.println("Making internal clock = new NTP time");
-      Serial.println();
+uint32_t TS_get_time(const uint32_t *payload, TSState &state)
+{
+  int32_t dod;
+  if (TS_get_bits(payload, state, 1) == 0)
+  {
+    dod = 0;
+  }
+  else if (TS_get_bits(payload, state, 1) == 0)
+  {
+    dod = (int32_t)TS_get_bits(payload, state, 7) - 63;
+  }
+  else if (TS_get_bits(payload, state, 1) == 0)
+  {
+    dod = (int32_t)TS_get_bits(payload, state, 9) - 255;
+  }
+  else if (TS_get_bits(payload, state, 1) == 0)
+  {
+    dod = (int32_t)TS_get_bits(payload, state, 12) - 2047;
+  }
+  else
+  {
+    dod = (int32_t)TS_get_bits(payload, state, 32);
+  }
 
-      lastepochcount = 0;     //With a good epoch reset the bad epoch counter to zero
-      lastepoch = epoch;      //With a good epoch make lastepoch the new good one for next loop
-      epochstart = epoch;     //Using NTP epoch time.  Reset the millis time variables to use this as new starting point
-      startmillis = millis(); //Using NTP epoch time.  Reset the millis time variables to use this as new starting point
-    }
+  state.delta += dod;
+  state.time += state.delta;
+  return state.time;
+}
 
-    Serial.print("new NTP epoch = ");
-    Serial.print(epoch);
-    Serial.print(",   Millis epoch = ");
-    Serial.println(lastepoch);
+//Start a new, empty RAM block
+void TS_new_block(uint32_t time)
+{
+  memset(&ts_block, 0, sizeof(ts_block));
+  memset(&ts_writer, 0, sizeof(ts_writer));
+  ts_block.magic = TS_MAGIC;
+  ts_block.sequence = ts_sequence;
+  ts_block.start_time = time;
+  ts_writer.time = time;
+}
 
-    Last_NTP_millis = millis(); //Set the last millis time the NTP time was attempted
-    RequestedTime = 0;
-    TimeCheckLoop = 0;
+//Add a 5min reading.  pressure and temp are in 0.1 hPa / 0.1 C
+void TS_append(uint32_t time, int pressure_tenths, int temp_tenths)
+{
+  uint32_t start_micros = micros();
 
-    ret_val = true;
+  if (ts_block.count > 0 && ts_writer.bit > TS_PAYLOAD_BITS - TS_MAX_SAMPLE_BITS)
+  {
+    TS_flush();
   }
 
-  if (!ret_val)
+  if (ts_block.count == 0)
   {
-    Serial.println("no packet yet");
+    TS_new_block(time);
   }
 
-  return ret_val;
+  TS_put_time(time);
+  TS_put_value(0, (uint32_t)pressure_tenths);
+  TS_put_value(1, (uint32_t)temp_tenths);
+  ts_block.count++;
+  ts_block.bits = ts_writer.bit;
+
+  ts_append_micros = micros() - start_micros;
 }
 
-// send an NTP request to the time server at the given address
-void sendNTPpacket(const IPAddress &address)
+//CRC of a block, skipping its crc word.  32 bit reads only so it works straight from mapped flash
+uint32_t TS_block_crc(const TSBlock *block)
 {
-  Serial.println("sending NTP packet");
-  // set all bytes in the buffer to 0
-  memset(packetBuffer, 0, NTP_PACKET_SIZE);
-  // Initialize values needed to form NTP request
-  // (see URL above for details on the packets)
-  packetBuffer[0] = 0b11100011; // LI, Version, Mode
-  packetBuffer[1] = 0;          // Stratum, or type of clock
-  packetBuffer[2] = 6;          // Polling Interval
-  packetBuffer[3] = 0xEC;       // Peer Clock Precision
-  // 8 bytes of zero for Root Delay & Root Dispersion
-  packetBuffer[12] = 49;
-  packetBuffer[13] = 0x4E;
-  packetBuffer[14] = 49;
-  packetBuffer[15] = 52;
+  const uint32_t *words = (const uint32_t *)block;
+  uint32_t crc = 0;
 
-  // all NTP fields have been given values, now
-  // you can send a packet requesting a timestamp:
-  udp.beginPacket(address, 123); //NTP requests are to port 123
-  udp.write(packetBuffer, NTP_PACKET_SIZE);
-  udp.endPacket();
+  for (int i = 0; i < (int)(sizeof(TSBlock) / 4); i++)
+  {
+    if (i == TS_CRC_WORD)
+    {
+      continue;
+    }
+    uint32_t word = words[i];
+    crc = crc32_calc((const uint8_t *)&word, 4, crc);
+  }
+  return crc;
 }
 
-void LocalClock()
+//Write the RAM block to its slot in the history flash.  Slots are used in order round the whole area, so every sector
+//gets erased the same number of times (wear levelling).  The sector is erased when the first slot in it is reached
+void TS_flush()
 {
+  uint32_t start_micros = micros();
 
-  int local_hour = local_clock_minutes_from_midnight / 60; //Turn minutes into the hour, needed for chime check
-  String AMPM = "AM";
+  ts_block.crc = TS_block_crc(&ts_block);
 
-  if (local_hour > 12)
+  uint32_t slot = ts_sequence % TS_BLOCKS;
+  uint32_t address = TS_FLASH_START + slot * sizeof(TSBlock);
+
+  bool good = flash_reserved_ok;
+  if (good && slot % TS_BLOCKS_PER_SECTOR == 0)
   {
-    AMPM = "PM";
-    local_hour -= 12;
+    good = ESP.flashEraseSector(address / SPI_FLASH_SEC_SIZE);
+  }
+  if (good)
+  {
+    good = ESP.flashWrite(address, (uint32_t *)&ts_block, sizeof(ts_block));
   }
 
-  if (verbose_output == 1)
+  if (!good)
   {
-    Serial.println();
-    Serial.print("Local time: ");
-    Serial.print(local_hour);
-    Serial.print(":");
+    Serial.println("History flash write failed");
+  }
 
-    if (minute_UTC < 10)
-    {
-      Serial.print("0");
+  Serial.print("History block ");
+  Serial.print(ts_sequence);
+  Serial.print(" written, ");
+  Serial.print(ts_block.count);
+  Serial.print(" samples, ");
+  Serial.print((ts_block.bits + 7) / 8.0 / ts_block.count);
+  Serial.print(" bytes/sample, took (us) ");
+  Serial.println(micros() - start_micros);
+
+  ts_sequence++;
+  ts_block.count = 0;
+}
+
+//Before a restart: write the part filled RAM block (up to 8 hours of readings) so it isn't lost.  It takes a slot of
+//its own, the next boot starts a new block
+void TS_save()
+{
+  if (ts_block.count > 0)
+  {
+    TS_flush();
+  }
+}
+
+//Block in a slot, read in place through the memory mapped flash (no copy).  NULL if the slot isn't a good block
+const TSBlock *TS_flash_block(uint32_t slot)
+{
+  if (!flash_reserved_ok)
+  {
+    return NULL;
+  }
+
+  const TSBlock *block = (const TSBlock *)(history_flash + slot * sizeof(TSBlock));
+
+  if (block->magic != TS_MAGIC || block->count > TS_PAYLOAD_BITS || block->crc != TS_block_crc(block))
+  {
+    return NULL;
+  }
+  return block;
+}
+
+//Decode every reading in a block, oldest first
+void TS_decode_block(const TSBlock *block, uint32_t from_time, void (*callback)(uint32_t, int, int))
+{
+  TSState state;
+  memset(&state, 0, sizeof(state));
+  state.time = block->start_time;
+
+  const uint32_t *payload = (const uint32_t *)block->payload;
+  uint32_t count = block->count;
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    uint32_t time = TS_get_time(payload, state);
+    int pressure_tenths = (int32_t)TS_get_value(payload, state, 0);
+    int temp_tenths = (int32_t)TS_get_value(payload, state, 1);
+
+    if (time >= from_time)
+    {
+      callback(time, pressure_tenths, temp_tenths);
+    }
+  }
+}
+
+//Call callback(time, pressure_tenths, temp_tenths) for every stored reading from from_time on, oldest first.  Returns the
+//number of blocks decoded.  Blocks are read where they sit in flash, so this runs at flash cache speed
+int TS_scan(uint32_t from_time, void (*callback)(uint32_t, int, int))
+{
+  int blocks = 0;
+  uint32_t first = (ts_sequence > TS_BLOCKS) ? ts_sequence - TS_BLOCKS : 0;
+  const TSBlock *block = NULL;
+
+  for (uint32_t sequence = first; sequence < ts_sequence; sequence++)
+  {
+    const TSBlock *next = TS_flash_block(sequence % TS_BLOCKS);
+    if (next == NULL || next->sequence != sequence)
+    {
+      continue;
+    }
+
+    //A block is only needed if the next one starts after from_time
+    if (block != NULL && next->start_time > from_time)
+    {
+      TS_decode_block(block, from_time, callback);
+      blocks++;
+    }
+    block = next;
+    yield();
+  }
+
+  if (block != NULL)
+  {
+    TS_decode_block(block, from_time, callback);
+    blocks++;
+  }
+
+  if (ts_block.count > 0)
+  {
+    TS_decode_block(&ts_block, from_time, callback);
+    blocks++;
+  }
+
+  return blocks;
+}
+
+int ts_scan_count;
+void TS_count_reading(uint32_t time, int pressure_tenths, int temp_tenths)
+{
+  ts_scan_count++;
+}
+
+//Log the readings taken before the time was known, oldest first, timed from how long ago they were read
+void TS_pending_flush()
+{
+  for (int age = pending_readings.size() - 1; age >= 0; age--)
+  {
+    const PendingReading &reading = pending_readings.at(age);
+    uint32_t time = current_timestamp - (millis() - reading.read_millis) / 1000;
+    TS_append(time, reading.pressure_tenths, reading.temp_tenths);
+    Rollup_add(time, reading.pressure_tenths);
+  }
+
+  if (pending_readings.size() > 0)
+  {
+    Serial.print("Logged readings from before the time was known: ");
+    Serial.println(pending_readings.size());
+  }
+  pending_readings.clear();
+}
+
+//Boot: is the sketch clear of the reserved flash, and will an OTA update stay clear of it
+void Flash_reserved_check()
+{
+  uint32_t sketch_size = ESP.getSketchSize();
+  uint32_t sketch_sectors = (sketch_size + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE;
+  uint32_t ota_start = ((uintptr_t)&_FS_start - FLASH_MAPPED) - sketch_sectors * SPI_FLASH_SEC_SIZE;
+
+  flash_reserved_ok = (sketch_size <= FLASH_RESERVED_START);
+  if (!flash_reserved_ok)
+  {
+    Serial.println("Sketch has grown into the reserved flash, no history or sun table");
+  }
+  else if (ota_start < FLASH_RESERVED_END)
+  {
+    Serial.println("Flash layout stages OTA updates over the reserved flash, history is lost on an OTA update");
+  }
+}
+
+//Is a slot still erased, so a block can be written straight in
+bool TS_slot_blank(uint32_t slot)
+{
+  const uint32_t *words = (const uint32_t *)(history_flash + slot * sizeof(TSBlock));
+  for (uint32_t i = 0; i < sizeof(TSBlock) / 4; i++)
+  {
+    if (words[i] != 0xFFFFFFFF)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+//Where the circular list got up to
+void TS_find_end()
+{
+  ts_sequence = 0;
+
+  for (uint32_t slot = 0; slot < TS_BLOCKS; slot++)
+  {
+    const TSBlock *block = TS_flash_block(slot);
+    if (block != NULL && block->sequence + 1 > ts_sequence)
+    {
+      ts_sequence = block->sequence + 1;
+    }
+  }
+
+  //A block torn by a restart mid write fails its CRC but leaves its slot part written, and writing over it would mix
+  //the bits.  Erasing would take the good blocks before it in the sector too, so go past it instead: TS_scan() skips
+  //the missing sequence numbers, and a sector start is erased as it's written anyway
+  while (flash_reserved_ok && ts_sequence % TS_BLOCKS_PER_SECTOR != 0 && !TS_slot_blank(ts_sequence % TS_BLOCKS))
+  {
+    Serial.print("History slot part written, skipped: ");
+    Serial.println(ts_sequence % TS_BLOCKS);
+    ts_sequence++;
+  }
+
+  ts_block.count = 0;
+}
+
+//Boot: find where the circular list got up to, then report size and scan speed
+void TS_begin()
+{
+  TS_find_end();
+
+  ts_scan_count = 0;
+  uint32_t start_micros = micros();
+  int blocks = TS_scan(0, TS_count_reading);
+  uint32_t scan_micros = micros() - start_micros;
+
+  Serial.print("History: ");
+  Serial.print(ts_scan_count);
+  Serial.print(" readings in ");
+  Serial.print(blocks);
+  Serial.print(" blocks (");
+  Serial.print(ts_scan_count > 0 ? (float)blocks * sizeof(TSBlock) / ts_scan_count : 0);
+  Serial.print(" bytes/reading), scan took (us) ");
+  Serial.println(scan_micros);
+}
+
+void do_blynk()
+{
+  //**************************Sending Data to Blynk and ThingSpeak*********************************
+  // code block for uploading data to BLYNK App
+
+  // if (App1 == "BLYNK") {
+  //  Blynk.virtualWrite(0, measured_temp);            // virtual pin 0
+  //  Blynk.virtualWrite(1, measured_humi);            // virtual pin 1
+  Blynk.virtualWrite(2, measured_pres);        // virtual pin 2
+  Blynk.virtualWrite(3, rel_pressure_rounded); // virtual pin 3
+  Blynk.virtualWrite(7, ZambrettisWords);      // virtual pin 7
+  Blynk.virtualWrite(8, accuracy_in_percent);  // virtual pin 8
+
+  if (accuracy < accuracygate)
+  {
+    Blynk.virtualWrite(9, "No trend"); // virtual pin 9
+  }
+  else
+  {
+    Blynk.virtualWrite(9, trend_in_words); // virtual pin 9
+  }
+}
+
+void update_epoch_time()
+{
+  //update current time with millis
+  current_timestamp = millis_unix_timestamp_baseline + ((millis() - millis_unix_timestamp) / 1000);
+
+  epoch = epochstart + (((millis() - startmillis) / 1000) * timefactor); //Get epoch from millis count.  May get over writtem by NTP pull.  timefactor is for testing to accellerate time for testing
+  printNTP = 0;                                                          //Flag to state time was not from an NTP request.
+
+  //Update the time.  NTP pull is only done periodically based on NTP_Seconds_to_wait, we count millis (pretty accurate) when not getting NTP time
+  Seconds_SinceLast_NTP_millis = (millis() - Last_NTP_millis) / 1000; //How many seconds since Last_NTP_millis pull
+
+  if (Seconds_SinceLast_NTP_millis > NTP_Seconds_to_wait && wifi_online == true) //Offline the millis count carries on
+  {
+    if (verbose_output == 1)
+    {
+      Serial.print("millis = ");
+      Serial.println(millis());
+      Serial.print("start millis = ");
+      Serial.println(startmillis);
+      Serial.print("epochstart = ");
+      Serial.println(epochstart);
+      Serial.print("epoch = ");
+      Serial.println(epoch);
+      Serial.println("");
+    }
+
+    Request_Time(); //Ask all the NTP servers
+    printNTP = 1;   //1 is a flag to serialprint the time (only used for NTP pull not for millis updates)
+    unsigned long wait_millis = millis();
+
+    while (!Check_Time()) //Picks the best reply once they're in, returns a False until then
+    {                     //Polled often so each reply's arrival time (and so its round trip) is accurate
+      delay(10);
+      if (millis() - wait_millis < 2000)
+      {
+        continue;
+      }
+      wait_millis = millis();
+      Serial.println("No packets, NTP Wait...");
+      TimeCheckLoop++;
+
+      //If after 5 tries, Give up and exit the NTP function, reset the loop counter.  epoch already updated from Millis()
+      if (TimeCheckLoop >= 5)
+      {
+        TimeCheckLoop = 0;
+        break;
+      }
+      else if (TimeCheckLoop > 2)
+      {
+        //If after 2 tried then try re-requesting the time
+        retryNTP += 1; //Update the counter for informational only, not used in the program
+        Request_Time();
+      }
+    }
+
+    //Time confirmed received and more than wait period to pull NTP / Sunrise time
+    Last_NTP_millis = millis(); //Set the Last_NTP_millis time to now - resets the wait time
+
+    if (verbose_output == 1)
+    {
+      Serial.println();
+      Serial.println("********************************************************");
+      Serial.println();
+    }
+
+    yield();
+    NTP_Seconds_to_wait = NTPSecondstowait; //Over write the initial wait period (1 sec) to the ongoing period (e.g 600 sec)
+  }
+  current_timestamp = epoch;
+}
+
+//Ask every NTP server for the time.  The replies are picked up by Check_Time()
+void Request_Time()
+{
+  Serial.println("Getting Time");
+  ntp_nonce = random(0x7FFFFFFF);
+  ntp_first_reply_millis = 0;
+
+  for (int i = 0; i < NTP_SERVERS; i++)
+  {
+    NTPServer &ntp = ntp_servers[i];
+    ntp.answered = false;
+    ntp.sent_millis = 0;
+    if (!Net_resolve(ntp.name, ntp.address))
+    {
+      continue;
+    }
+    sendNTPpacket(ntp.address); // send an NTP packet to a time server
+    ntp.sent_millis = max(millis(), 1UL);
+    ntp.requests++;
+  }
+}
+
+//Big endian 32 bits from an NTP packet
+uint32_t NTP_word(const byte *data)
+{
+  return (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3];
+}
+
+//NTP timestamp (seconds since 1900 and a 32 bit fraction) as Unix time in ms
+int64_t NTP_unix_ms(const byte *data)
+{
+  const unsigned long seventyYears = 2208988800UL; // Unix time starts on Jan 1 1970. In seconds, that's 2208988800
+  return (int64_t)(NTP_word(data) - seventyYears) * 1000 + (((uint64_t)NTP_word(data + 4) * 1000) >> 32);
+}
+
+//One reply in packetBuffer, from a server asked this round.  Works out its round trip and what it says the time is
+void NTP_sample(const IPAddress &from, unsigned long receive_millis)
+{
+  NTPServer *ntp = NULL;
+  for (int i = 0; i < NTP_SERVERS; i++)
+  {
+    if (ntp_servers[i].sent_millis != 0 && !ntp_servers[i].answered && ntp_servers[i].address == from)
+    {
+      ntp = &ntp_servers[i];
+    }
+  }
+
+  //Server mode, synchronised (stratum 1-15) and answering this round's request
+  int stratum = packetBuffer[1];
+  if (ntp == NULL || (packetBuffer[0] & 0x07) != 4 || stratum < 1 || stratum > 15 || NTP_word(packetBuffer + 28) != ntp_nonce)
+  {
+    Serial.println("NTP reply ignored");
+    return;
+  }
+
+  int64_t received_ms = NTP_unix_ms(packetBuffer + 32); //When the server got the request
+  int64_t sent_ms = NTP_unix_ms(packetBuffer + 40);     //When it sent the reply
+  int32_t delay_ms = (int32_t)(receive_millis - ntp->sent_millis) - (int32_t)(sent_ms - received_ms);
+  delay_ms = max(delay_ms, (int32_t)0);
+
+  int64_t now_ms = sent_ms + delay_ms / 2; //Server time when the reply got here
+  ntp->answered = true;
+  ntp->delay_ms = delay_ms;
+  ntp->millis_offset = now_ms - receive_millis;
+  ntp->offset_ms = (time_valid == true) ? (int32_t)(now_ms - ((int64_t)epochstart * 1000 + (receive_millis - startmillis))) : 0;
+  ntp->replies++;
+  ntp->delay_total_ms += delay_ms;
+
+  if (ntp_first_reply_millis == 0)
+  {
+    ntp_first_reply_millis = max(receive_millis, 1UL);
+  }
+}
+
+//Best reply this round, -1 if none will do.  The median reply is taken as right, any whose time doesn't overlap it (within
+//their round trips) are thrown out, and the one left with the shortest round trip is used.  Once the clock is set,
+//moving it more than an hour needs two servers that agree
+int NTP_select()
+{
+  int order[NTP_SERVERS];
+  int answered = 0;
+  for (int i = 0; i < NTP_SERVERS; i++)
+  {
+    if (ntp_servers[i].answered)
+    {
+      order[answered++] = i;
+    }
+  }
+  if (answered == 0)
+  {
+    return -1;
+  }
+
+  //Sort by what they say the time is (only a few, insertion sort)
+  for (int i = 1; i < answered; i++)
+  {
+    for (int j = i; j > 0 && ntp_servers[order[j]].millis_offset < ntp_servers[order[j - 1]].millis_offset; j--)
+    {
+      int swap = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = swap;
+    }
+  }
+
+  const NTPServer &median = ntp_servers[order[answered / 2]];
+  int best = -1;
+  int agree = 0;
+  for (int i = 0; i < answered; i++)
+  {
+    const NTPServer &ntp = ntp_servers[order[i]];
+    int64_t difference = ntp.millis_offset - median.millis_offset;
+    if (difference < 0)
+    {
+      difference = -difference;
+    }
+
+    if (difference > ntp.delay_ms / 2 + median.delay_ms / 2 + ntp_tolerance_ms)
+    {
+      Serial.print("NTP server disagrees, not used: ");
+      Serial.println(ntp.name);
+      continue;
+    }
+    agree++;
+    if (best < 0 || ntp.delay_ms < ntp_servers[best].delay_ms)
+    {
+      best = order[i];
+    }
+  }
+
+  if (time_valid == true && agree < 2 && abs(ntp_servers[best].offset_ms) > 3600000L)
+  {
+    totalfailepoch = totalfailepoch + 1;
+    Serial.print("Only one NTP server and it's over an hour out, keeping the millis clock.  previously failed = ");
+    Serial.println(totalfailepoch);
+    return -1;
+  }
+  return best;
+}
+
+//Round trip and offset for each server, * = the one used
+void NTP_report()
+{
+  for (int i = 0; i < NTP_SERVERS; i++)
+  {
+    const NTPServer &ntp = ntp_servers[i];
+    Serial.print(i == ntp_chosen ? "* " : "  ");
+    Serial.print(ntp.name);
+    if (ntp.answered)
+    {
+      Serial.print("  rtt (ms) ");
+      Serial.print(ntp.delay_ms);
+      Serial.print(", offset (ms) ");
+      Serial.print(ntp.offset_ms);
+    }
+    else
+    {
+      Serial.print("  no reply");
+    }
+    Serial.print(", replies ");
+    Serial.print(ntp.replies);
+    Serial.print("/");
+    Serial.print(ntp.requests);
+    Serial.print(", average rtt (ms) ");
+    Serial.println(ntp.replies > 0 ? ntp.delay_total_ms / ntp.replies : 0);
+  }
+}
+
+//This returns a bool value based on UDP time being received and placed in epoch variable.  Takes in every reply waiting,
+//and once all the servers have answered (or ntp_collect_millis after the first did) sets the clock from the best one
+bool Check_Time()
+{
+  for (int cb = udp.parsePacket(); cb > 0; cb = udp.parsePacket())
+  {
+    unsigned long receive_millis = millis();
+    // We've received a packet, read the data from it
+    udp.read(packetBuffer, NTP_PACKET_SIZE); // read the packet into the buffer
+    if (cb >= NTP_PACKET_SIZE)
+    {
+      NTP_sample(udp.remoteIP(), receive_millis);
+    }
+  }
+
+  int asked = 0, answered = 0;
+  for (int i = 0; i < NTP_SERVERS; i++)
+  {
+    asked += (ntp_servers[i].sent_millis != 0);
+    answered += ntp_servers[i].answered;
+  }
+  if (answered == 0 || (answered < asked && millis() - ntp_first_reply_millis < ntp_collect_millis))
+  {
+    return false;
+  }
+
+  //Round over, late replies are ignored
+  for (int i = 0; i < NTP_SERVERS; i++)
+  {
+    ntp_servers[i].sent_millis = 0;
+  }
+
+  int best = NTP_select();
+  if (best >= 0)
+  {
+    ntp_chosen = best;
+    int64_t now_ms = ntp_servers[best].millis_offset + millis();
+    lastepoch = epoch; //Used to compare last known epoch time with new NTP
+    epoch = now_ms / 1000;
+    epochstart = epoch;                      //Using NTP epoch time.  Reset the millis time variables to use this as new starting point
+    startmillis = millis() - now_ms % 1000; //Keeps the part second, so the millis clock ticks over with the real one
+
+    Serial.print("new NTP epoch = ");
+    Serial.print(epoch);
+    Serial.print(",   Millis epoch = ");
+    Serial.println(lastepoch);
+  }
+  NTP_report();
+
+  Last_NTP_millis = millis(); //Set the last millis time the NTP time was attempted
+  RequestedTime = 0;
+  TimeCheckLoop = 0;
+
+  return best >= 0 || time_valid == true;
+}
+
+// send an NTP request to the time server at the given address
+void sendNTPpacket(const IPAddress &address)
+{
+  Serial.println("sending NTP packet");
+  // set all bytes in the buffer to 0
+  memset(packetBuffer, 0, NTP_PACKET_SIZE);
+  // Initialize values needed to form NTP request
+  // (see URL above for details on the packets)
+  packetBuffer[0] = 0b11100011; // LI, Version, Mode
+  packetBuffer[1] = 0;          // Stratum, or type of clock
+  packetBuffer[2] = 6;          // Polling Interval
+  packetBuffer[3] = 0xEC;       // Peer Clock Precision
+  // 8 bytes of zero for Root Delay & Root Dispersion
+  packetBuffer[12] = 49;
+  packetBuffer[13] = 0x4E;
+  packetBuffer[14] = 49;
+  packetBuffer[15] = 52;
+
+  //Transmit timestamp fraction = this round's nonce, the server sends it back as the originate timestamp
+  packetBuffer[44] = ntp_nonce >> 24;
+  packetBuffer[45] = ntp_nonce >> 16;
+  packetBuffer[46] = ntp_nonce >> 8;
+  packetBuffer[47] = ntp_nonce;
+
+  // all NTP fields have been given values, now
+  // you can send a packet requesting a timestamp:
+  udp.beginPacket(address, 123); //NTP requests are to port 123
+  udp.write(packetBuffer, NTP_PACKET_SIZE);
+  udp.endPacket();
+}
+
+void LocalClock()
+{
+
+  int local_hour = local_clock_minutes_from_midnight / 60; //Turn minutes into the hour, needed for chime check
+  String AMPM = "AM";
+
+  if (local_hour > 12)
+  {
+    AMPM = "PM";
+    local_hour -= 12;
+  }
+
+  if (verbose_output == 1)
+  {
+    Serial.println();
+    Serial.print("Local time: ");
+    Serial.print(local_hour);
+    Serial.print(":");
+
+    if (minute_UTC < 10)
+    {
+      Serial.print("0");
+    }
+
+    Serial.print(minute_UTC);
+    Serial.print(" ");
+    Serial.println(AMPM);
+
+    Serial.println();
+  }
+}
+
+//Calculate LED colours phases on the phase of the sun using sunrise API data and NTP time converted to local time (using UTC offset)
+void nightday_DoTheLEDs()
+{
+  if (verbose_output == 1)
+  {
+    // Serial.print("UTC Hour: ");
+    // Serial.print(hour);
+    // Serial.print(",   Minute: ");
+    // Serial.print(minute);
+    // Serial.print(",   Second: ");
+    // Serial.print(second);
+    // Serial.println();
+  }
+  //Check for sunrise.  clock_minutes_from_midnight is time in minutes from midnight.  Sunrise/set minutes and clock are both UTC
+  //Only compare UTC with UTC as local time (using UTC offset can change with daylight savings).  Local only for figuring out if it's night or day
+
+  //Find out if it's day or night, for the hard on/off of light mode 2.  The other modes follow the sky curve
+  //Using Local UTC (don't care about daylight saving) for day or night
+  if (local_clock_minutes_from_midnight > local_sunrise_minutes_from_midnight && local_clock_minutes_from_midnight < local_sunset_minutes_from_midnight)
+  {
+    night = 0;
+  }
+  else
+  {
+    night = 1;
+  }
+
+  if (verbose_output == 1)
+  {
+
+    Serial.print("clock_minutes_from_midnight (UTC) = ");
+    Serial.print(clock_minutes_from_midnight);
+    Serial.print(",   local_clock_minutes_from_midnight = ");
+    Serial.println(local_clock_minutes_from_midnight);
+    Serial.print("sunrise minutes_from_midnight (UTC) = ");
+    Serial.print(sunrise_minutes_from_midnight);
+    Serial.print(",   sunset_minutes_from_midnight (UTC) = ");
+    Serial.println(sunset_minutes_from_midnight);
+    Serial.print("Seconds_SinceLast_NTP_millis: ");
+    Serial.print(Seconds_SinceLast_NTP_millis);
+    Serial.print(",   Startmillis: ");
+    Serial.print(startmillis);
+    Serial.print(",   epochstart: ");
+    Serial.print("API stale (s): ");
+    Serial.print(API_stale_seconds());
+    Serial.println(epochstart);
+    Serial.println();
+    Serial.print("flash_phase = ");
+    Serial.print(flash_phase);
+    Serial.print(",   night = ");
+    Serial.print(night);
+    Serial.print(",   Sky curve slot = ");
+    Serial.print((epoch % 86400) / (SKY_SLOT_MINUTES * 60));
+    Serial.print(", retryNTP = ");
+    Serial.println(retryNTP);
+  }
+
+  //call function to select LED colours for either all day/night or just nightlight
+  if (time_valid == false)
+  {
+    //No clock (offline, WiFi setup portal open) so the sun can't be placed.  Just be a lamp
+    red = red_day;
+    green = green_day;
+    blue = blue_day;
+  }
+  else if (lightmode == 0)
+  {
+    daynight();
+  }
+  else
+  {
+    nightlight();
+  }
+
+  fill_solid(leds, NUM_LEDS_PER_STRIP, CRGB(red, green, blue));
+
+  //Set the top light:  0=Same as other LEDs, 1=Red, 2=Green, 3=Blue, 4=White
+  if (TARDIS == 1)
+  {
+    leds[NUM_LEDS_PER_STRIP - 1].setRGB(255, 0, 0); //Light on top of TARDIS Red
+  }
+
+  if (TARDIS == 2)
+  {
+    leds[NUM_LEDS_PER_STRIP - 1].setRGB(0, 255, 0); //Light on top of TARDIS Green
+  }
+
+  if (TARDIS == 3)
+  {
+    leds[NUM_LEDS_PER_STRIP - 1].setRGB(0, 0, 255); //Light on top of TARDIS Blue
+  }
+
+  if (TARDIS == 4)
+  {
+    leds[NUM_LEDS_PER_STRIP - 1].setRGB(255, 255, 255); //Light on top of TARDIS White
+  }
+
+  FastLED.setBrightness(brightness);
+  FastLED.show();
+
+  if (verbose_output == 1)
+  {
+    Serial.print("red = ");
+    Serial.print(red);
+    Serial.print(",   blue = ");
+    Serial.print(blue);
+    Serial.print(",   green = ");
+    Serial.println(green);
+    Serial.println();
+    Serial.println("********************************************************");
+    Serial.println();
+    Serial.print("Working mode = ");
+    Serial.print(working_mode);
+    
+    if (working_mode == true){
+      Serial.println(" : Night light mode");
+    }
+    else
+    {
+      Serial.println(" : Weather mode");
+    }
+    
+    Serial.println();
+    Serial.println("********************************************************");
+    Serial.println("");
+  }
+}
+
+//daunight mode:  yellow during day, blue at night, sunrise/set colours in between
+void daynight()
+{
+  CRGB colour = Sky_colour(epoch);
+  red = colour.r;
+  green = colour.g;
+  blue = colour.b;
+}
+
+//nightlight mode:  Off during day, yellow during night
+void nightlight()
+{
+  //Mode 1: sunrise/set colours in between, from the sky curve (built the other way round for this mode)
+  if (lightmode == 1)
+  {
+    CRGB colour = Sky_colour(epoch);
+    red = colour.r;
+    green = colour.g;
+    blue = colour.b;
+  }
+
+  //Mode 2
+  if (lightmode == 2 && night == 0) //I'm in mode 2 and it's daytime - LEDs off
+  {
+    blue = 0;
+    green = 0;
+    red = 0;
+  }
+
+  if (lightmode == 2 && night == 1) //I'm in mode 2 and it's night time - LEDs yellow
+  {
+    blue = blue_day;
+    green = green_day;
+    red = red_day;
+  }
+}
+
+//Colour for an elevation, straight line between the stops either side.  Held at the end colours past the ends
+CRGB Sky_stop_colour(const SkyStop *stops, int count, float elevation)
+{
+  if (elevation <= stops[0].elevation)
+  {
+    return CRGB(stops[0].red, stops[0].green, stops[0].blue);
+  }
+
+  for (int i = 1; i < count; i++)
+  {
+    if (elevation < stops[i].elevation)
+    {
+      float part = (elevation - stops[i - 1].elevation) / (stops[i].elevation - stops[i - 1].elevation);
+      return CRGB(stops[i - 1].red + (stops[i].red - stops[i - 1].red) * part, stops[i - 1].green + (stops[i].green - stops[i - 1].green) * part,
+                  stops[i - 1].blue + (stops[i].blue - stops[i - 1].blue) * part);
+    }
+  }
+  return CRGB(stops[count - 1].red, stops[count - 1].green, stops[count - 1].blue);
+}
+
+//Work out the sky colour for every slot of the day from the sun's elevation.  The trig is all here, once a day (and when
+//the light mode changes), so the transitions last as long as the real twilight does at this latitude and time of year
+void Sky_build()
+{
+  if (solar_valid == false)
+  {
+    return;
+  }
+
+  uint32_t start_micros = micros();
+
+  //Stops from the lamp's day and night colours, red at sunrise/set between them
+  SkyStop stops[SKY_STOPS_MAX];
+  int count = 0;
+  if (lightmode == 1)
+  {
+    //Light mode 1: the other way round.  Day colour at night, red at sunrise/set, night colour and then off during the day
+    stops[count++] = {-12.0f, (uint8_t)red_day, (uint8_t)green_day, (uint8_t)blue_day};
+    stops[count++] = {-0.833f, 255, 0, 0};
+    stops[count++] = {6.0f, (uint8_t)red_night, (uint8_t)green_night, (uint8_t)blue_night};
+    stops[count++] = {9.0f, 0, 0, 0};
+  }
+  else
+  {
+    //Light mode 0: night colour, through red at sunrise/set (night fades from nautical twilight), up to the day colour
+    stops[count++] = {-12.0f, (uint8_t)red_night, (uint8_t)green_night, (uint8_t)blue_night};
+    stops[count++] = {-0.833f, 255, 0, 0};
+    stops[count++] = {6.0f, (uint8_t)red_day, (uint8_t)green_day, (uint8_t)blue_day};
+  }
+
+  float lat_sin = sinf(latitude * SOLAR_DEG_TO_RAD) * sinf(solar_declination);
+  float lat_cos = cosf(latitude * SOLAR_DEG_TO_RAD) * cosf(solar_declination);
+
+  for (int slot = 0; slot <= SKY_SLOTS; slot++)
+  {
+    float hour_angle = (slot * SKY_SLOT_MINUTES - solar_noon) / 4 * SOLAR_DEG_TO_RAD; //4 minutes a degree
+    float elevation = asinf(constrain(lat_sin + lat_cos * cosf(hour_angle), -1.0f, 1.0f)) * SOLAR_RAD_TO_DEG;
+    sky_curve[slot] = Sky_stop_colour(stops, count, elevation);
+  }
+
+  sky_valid = true;
+  sky_build_micros = micros() - start_micros;
+  Serial.print("Sky curve built, took (us) ");
+  Serial.println(sky_build_micros);
+}
+
+//Sky colour now.  Two table reads and a blend, the same cost every frame
+CRGB Sky_colour(uint32_t time)
+{
+  if (sky_valid == false)
+  {
+    return CRGB(red_night, green_night, blue_night);
+  }
+
+  uint32_t seconds = time % 86400;
+  uint32_t slot = seconds / (SKY_SLOT_MINUTES * 60);
+  uint8_t part = (seconds % (SKY_SLOT_MINUTES * 60)) * 256 / (SKY_SLOT_MINUTES * 60);
+  return blend(sky_curve[slot], sky_curve[slot + 1], part);
+}
+//***************************************************************************************************
+//Storage.  Everything goes through Storage (LittleFS).  A flash that still holds SPIFFS is moved
+//over once: the files are read into RAM, the area is formatted as LittleFS and they're written back
+//***************************************************************************************************
+
+//Time open, exists, read and append on a filesystem.  The appends are log sized, the slowest one shows GC stalls
+void Storage_benchmark(FS &fs, const char *name)
+{
+  const int runs = 100;
+  const char *benchfile = "/bench.tmp";
+  uint8_t data[12];
+  memset(data, 0x55, sizeof(data));
+
+  uint32_t open_micros = 0, exists_micros = 0, read_micros = 0, write_micros = 0, worst_write_micros = 0;
+  fs.remove(benchfile);
+
+  for (int i = 0; i < runs; i++)
+  {
+    uint32_t start_micros = micros();
+    File f = fs.open(benchfile, "a");
+    f.write(data, sizeof(data));
+    f.close();
+    uint32_t took = micros() - start_micros;
+    write_micros += took;
+    if (took > worst_write_micros)
+    {
+      worst_write_micros = took;
+    }
+
+    start_micros = micros();
+    fs.exists(benchfile);
+    exists_micros += micros() - start_micros;
+
+    start_micros = micros();
+    f = fs.open(benchfile, "r");
+    open_micros += micros() - start_micros;
+
+    start_micros = micros();
+    f.read(data, sizeof(data));
+    f.close();
+    read_micros += micros() - start_micros;
+    yield();
+  }
+
+  fs.remove(benchfile);
+
+  Serial.print(name);
+  Serial.print(" average (us) open ");
+  Serial.print(open_micros / runs);
+  Serial.print(", exists ");
+  Serial.print(exists_micros / runs);
+  Serial.print(", read ");
+  Serial.print(read_micros / runs);
+  Serial.print(", append ");
+  Serial.print(write_micros / runs);
+  Serial.print(", worst append ");
+  Serial.println(worst_write_micros);
+}
+
+//Copy every SPIFFS file over to LittleFS.  Both use the same flash so the files are held in RAM in between, they can't be
+//streamed across.  If anything doesn't fit in RAM nothing is formatted: SPIFFS is left as it is and storage stays off (storage_migrate_failed)
+bool Storage_migrate()
+{
+  const int max_files = 16;
+  const size_t max_bytes = 16384; //Plenty for settings and the pressure log, leaves heap for WiFi
+  String names[max_files];
+  uint8_t *contents[max_files];
+  size_t sizes[max_files];
+  int files = 0;
+  size_t total = 0;
+  bool all_fit = true;
+
+  //Only mount what's there.  SPIFFS would otherwise format a blank or LittleFS flash (tens of seconds) and find nothing.
+  //No benchmark either, it writes test files into what's being rescued
+  SPIFFSConfig spiffs_config;
+  spiffs_config.setAutoFormat(false);
+  SPIFFS.setConfig(spiffs_config);
+  if (!SPIFFS.begin())
+  {
+    return false;
+  }
+  Serial.println("Moving SPIFFS files to LittleFS");
+
+  Dir dir = SPIFFS.openDir("/");
+  while (dir.next())
+  {
+    size_t size = dir.fileSize();
+    if (files == max_files || total + size > max_bytes)
+    {
+      Serial.print("Too big to move: ");
+      Serial.println(dir.fileName());
+      all_fit = false;
+      break;
+    }
+
+    contents[files] = (uint8_t *)malloc(size + 1);
+    if (contents[files] == NULL)
+    {
+      Serial.print("No memory to move: ");
+      Serial.println(dir.fileName());
+      all_fit = false;
+      break;
+    }
+    File f = dir.openFile("r");
+    sizes[files] = f.read(contents[files], size);
+    f.close();
+    names[files] = dir.fileName();
+    total += size;
+    files++;
+  }
+  SPIFFS.end();
+
+  if (!all_fit)
+  {
+    for (int i = 0; i < files; i++)
+    {
+      free(contents[i]);
+    }
+    Serial.println("SPIFFS left as it is, storage off.  Take the files off and format (reset button) to go on");
+    storage_migrate_failed = true;
+    return false;
+  }
+
+  LittleFS.format();
+  bool mounted = LittleFS.begin();
+
+  for (int i = 0; i < files; i++)
+  {
+    if (mounted)
+    {
+      File f = LittleFS.open(names[i], "w");
+      f.write(contents[i], sizes[i]);
+      f.close();
+      Serial.print("Moved ");
+      Serial.println(names[i]);
+    }
+    free(contents[i]);
+  }
+
+  if (mounted)
+  {
+    Storage_benchmark(LittleFS, "LittleFS");
+  }
+  return mounted;
+}
+
+//Mount the storage, moving SPIFFS over or formatting the first time.  Safe to call more than once
+void Storage_begin()
+{
+  if (storage_mounted)
+  {
+    return;
+  }
+
+  //No auto format, a failed mount may be a SPIFFS flash with files to move
+  LittleFSConfig storage_config;
+  storage_config.setAutoFormat(false);
+  LittleFS.setConfig(storage_config);
+
+  storage_mounted = LittleFS.begin();
+  if (!storage_mounted)
+  {
+    storage_mounted = Storage_migrate();
+  }
+  if (!storage_mounted && !storage_migrate_failed)
+  {
+    Serial.println("FS not formatted. Doing that now...");
+    LittleFS.format();
+    storage_mounted = LittleFS.begin();
+  }
+
+  Serial.println(storage_mounted ? "LittleFS Initialize....ok" : "LittleFS Initialization...failed");
+
+  if (storage_benchmark)
+  {
+    Storage_benchmark(Storage, "LittleFS");
+  }
+}
+
+//Ask for a restart.  Happens from loop() after restart_delay
+void Restart_request(const char *reason)
+{
+  if (!restart_pending)
+  {
+    Serial.print("Restart requested by ");
+    Serial.println(reason);
+    restart_pending = true;
+    restart_request_millis = millis();
+  }
+}
+
+//Ask for the settings to be read again, from the text settings files if there are any else /config.bin
+void Reload_request(const char *reason)
+{
+  Serial.print("Settings reload requested by ");
+  Serial.println(reason);
+  reload_pending = true;
+}
+
+void Restart_check()
+{
+  if (reload_pending)
+  {
+    reload_pending = false;
+
+    //A text settings file (uploaded with PUT /file) changes just what it holds.  Otherwise only use /config.bin if it's good
+    //and not what we already have
+    ConfigRecord record = config;
+    if (Config_text_override(record))
+    {
+      Config_check(record);
+      Config_update(record, true);
+    }
+    else if (Config_load(record) && record.crc != config.crc)
+    {
+      Config_check(record);
+      Config_update(record, false);
+    }
+  }
+
+  if (restart_pending && millis() - restart_request_millis > restart_delay)
+  {
+    TS_save();
+    RTC_save();
+    ESP.restart();
+  }
+}
+
+//Switch to new settings while running.  Only redoes what the changes affect.  save = write them a little later
+void Config_update(const ConfigRecord &record, bool save)
+{
+  bool location_changed = (record.latitude != config.latitude || record.longitude != config.longitude);
+  bool UTC_changed = (record.UTC != config.UTC);
+  bool lightmode_changed = (record.lightmode != config.lightmode);
+
+  config = record;
+  Config_apply();
+
+  if (location_changed)
+  {
+    solar_valid = false;                                  //Sun times (and the table) for the new place
+    sun_table_year = 0;
+    sun_build_year = 0;
+    sun_build_tried = 0;
+    api_day = 0;                                          //and the API cross check, if on
+    api_next_millis = millis();
+    api_wait_millis = 0;                                  //now, not after whatever wait or backoff was running
+  }
+  if ((UTC_changed || location_changed) && time_valid == true)
+  {
+    decode_epoch(epoch); //Local clock and sunrise/set minutes
+  }
+  if (lightmode_changed)
+  {
+    Sky_build(); //Each light mode has its own colours
+  }
+  if (flash == 0)
+  {
+    flash_phase = 0;
+  }
+
+  if (save)
+  {
+    config_save_pending = true;
+    config_save_millis = millis();
+  }
+}
+
+//Write changed settings once they've stopped changing, so a run of edits is one write
+void Config_save_check()
+{
+  if (config_save_pending && millis() - config_save_millis > config_save_delay)
+  {
+    config_save_pending = false;
+    Config_save();
+  }
+}
+
+//First setting out of range, NULL if they're all good.  Same ranges as Config_check(), but reported rather than fixed
+const char *Config_range_error(const ConfigRecord &record)
+{
+  if (record.lightmode < 0 || record.lightmode > 2)
+  {
+    return "lightmode";
+  }
+  if (record.TARDIS < 0 || record.TARDIS > 4)
+  {
+    return "TARDIS";
+  }
+  if (record.flash < 0 || record.flash > 9)
+  {
+    return "flash";
+  }
+  if (record.brightness < 1 || record.brightness > 5)
+  {
+    return "brightness";
+  }
+  if (record.volume < 0 || record.volume > 9)
+  {
+    return "volume";
+  }
+  if (record.UTC < -13 || record.UTC > 13)
+  {
+    return "UTC";
+  }
+  if (record.latitude < -90 || record.latitude > 90)
+  {
+    return "latitude";
+  }
+  if (record.longitude < -180 || record.longitude > 180)
+  {
+    return "longitude";
+  }
+  return NULL;
+}
+
+//Settings as JSON.  chime is 24 digits, midnight first, 1 = chime
+String Config_json()
+{
+  char chime_text[25];
+  for (int hour = 0; hour < 24; hour++)
+  {
+    chime_text[hour] = (config.chime_mask & (1UL << hour)) ? '1' : '0';
+  }
+  chime_text[24] = 0;
+
+  String json = "{\"latitude\":" + String(config.latitude, 4);
+  json += ",\"longitude\":" + String(config.longitude, 4);
+  json += ",\"lightmode\":" + String((int)config.lightmode);
+  json += ",\"TARDIS\":" + String((int)config.TARDIS);
+  json += ",\"flash\":" + String((int)config.flash);
+  json += ",\"brightness\":" + String((int)config.brightness);
+  json += ",\"volume\":" + String((int)config.volume);
+  json += ",\"UTC\":" + String((int)config.UTC);
+  json += ",\"chime\":\"" + String(chime_text) + "\"}";
+  return json;
+}
+
+void Web_send_error(int code, const String &error)
+{
+  server.send(code, "application/json", "{\"error\":\"" + error + "\"}");
+}
+
+//HTTP basic auth with the WiFi name and password, the same login as FTP.  Sends the challenge and returns false without it
+bool Web_authorised()
+{
+  if (server.authenticate(recovered_ssid.c_str(), recovered_pass.c_str()))
+  {
+    return true;
+  }
+  server.requestAuthentication();
+  return false;
+}
+
+//Whole number field for Web_post_config().  Checked as an int before it goes near the int8_t, 400 and false if it is bad
+bool Web_int_field(JsonObject &root, const char *key, int low, int high, int8_t &field)
+{
+  if (!root.containsKey(key))
+  {
+    return true;
+  }
+  int value = root[key].as<int>();
+  if (!root[key].is<int>() || value < low || value > high)
+  {
+    Web_send_error(400, key);
+    return false;
+  }
+  field = value;
+  return true;
+}
+
+//As Web_int_field() for latitude / longitude
+bool Web_float_field(JsonObject &root, const char *key, float low, float high, float &field)
+{
+  if (!root.containsKey(key))
+  {
+    return true;
+  }
+  float value = root[key].as<float>();
+  if (!root[key].is<float>() || isnan(value) || value < low || value > high)
+  {
+    Web_send_error(400, key);
+    return false;
+  }
+  field = value;
+  return true;
+}
+
+void Web_get_config()
+{
+  if (!Web_authorised())
+  {
+    return;
+  }
+  server.send(200, "application/json", Config_json());
+}
+
+//POST /config with a JSON body holding any of the Config_json() fields.  All or nothing: one bad field changes nothing
+void Web_post_config()
+{
+  if (!Web_authorised())
+  {
+    return;
+  }
+  DynamicJsonBuffer jsonBuffer(512);
+  JsonObject &root = jsonBuffer.parseObject(server.arg("plain"));
+  if (!root.success())
+  {
+    Web_send_error(400, "bad JSON");
+    return;
+  }
+
+  ConfigRecord record = config;
+  if (!Web_float_field(root, "latitude", -90, 90, record.latitude) ||
+      !Web_float_field(root, "longitude", -180, 180, record.longitude) ||
+      !Web_int_field(root, "lightmode", 0, 2, record.lightmode) ||
+      !Web_int_field(root, "TARDIS", 0, 4, record.TARDIS) ||
+      !Web_int_field(root, "flash", 0, 9, record.flash) ||
+      !Web_int_field(root, "brightness", 1, 5, record.brightness) ||
+      !Web_int_field(root, "volume", 0, 9, record.volume) ||
+      !Web_int_field(root, "UTC", -13, 13, record.UTC))
+  {
+    return;
+  }
+  if (root.containsKey("chime"))
+  {
+    const char *chime_text = root["chime"];
+    if (chime_text == NULL || strlen(chime_text) != 24 || strspn(chime_text, "01") != 24)
+    {
+      Web_send_error(400, "chime");
+      return;
+    }
+    record.chime_mask = 0;
+    for (int hour = 0; hour < 24; hour++)
+    {
+      if (chime_text[hour] == '1')
+      {
+        record.chime_mask |= 1UL << hour;
+      }
+    }
+  }
+
+  const char *error = Config_range_error(record);
+  if (error != NULL)
+  {
+    Web_send_error(400, error);
+    return;
+  }
+
+  Config_update(record, true);
+  server.send(200, "application/json", Config_json());
+}
+
+void Web_post_restart()
+{
+  if (!Web_authorised())
+  {
+    return;
+  }
+  Restart_request("web");
+  server.send(200, "application/json", "{\"restart\":true}");
+}
+
+void Web_post_reload()
+{
+  if (!Web_authorised())
+  {
+    return;
+  }
+  Reload_request("web");
+  server.send(200, "application/json", "{\"reload\":true}");
+}
+
+//Sun times in use (UTC minutes from midnight) and how the API cross check is doing.  api_stale is -1 with no good API times
+void Web_get_sunrise()
+{
+  String json = "{\"sunrise\":" + String(sunrise_minutes_from_midnight);
+  json += ",\"sunset\":" + String(sunset_minutes_from_midnight);
+  json += ",\"api_check\":" + String(sunrise_api_check ? "true" : "false");
+  json += ",\"api_sunrise\":" + String(api_sunrise_minutes);
+  json += ",\"api_sunset\":" + String(api_sunset_minutes);
+  json += ",\"api_stale\":" + String(API_stale_seconds());
+  json += ",\"api_requests\":" + String(api_requests);
+  json += ",\"api_failures\":" + String(api_request_failures);
+  json += ",\"api_next\":" + String((long)(api_wait_millis - (millis() - api_next_millis)) / 1000) + "}";
+  server.send(200, "application/json", json);
+}
+
+//GET /pressure?from=&to= (Unix time, default the last 24 hours): min / max / mean in hPa and readings, from Rollup_query()
+void Web_get_pressure()
+{
+  uint32_t to = server.hasArg("to") ? strtoul(server.arg("to").c_str(), NULL, 10) : current_timestamp;
+  uint32_t from = server.hasArg("from") ? strtoul(server.arg("from").c_str(), NULL, 10) : to - 86400;
+  if (from >= to)
+  {
+    Web_send_error(400, "range");
+    return;
+  }
+
+  Rollup r = Rollup_query(from, to);
+  String json = "{\"from\":" + String(from);
+  json += ",\"to\":" + String(to);
+  json += ",\"count\":" + String(r.count);
+  if (r.count > 0)
+  {
+    json += ",\"min\":" + String(r.min / 10.0f, 1);
+    json += ",\"max\":" + String(r.max / 10.0f, 1);
+    json += ",\"mean\":" + String(r.sum / 10.0f / r.count, 1);
+  }
+  server.send(200, "application/json", json + "}");
+}
+
+//Outbound network counters.  dns_us and connect_us are the last lookup / new connection that actually went out
+void Web_get_net()
+{
+  String json = "{\"dns_lookups\":" + String(net_dns_lookups);
+  json += ",\"dns_hits\":" + String(net_dns_hits);
+  json += ",\"dns_us\":" + String(net_dns_micros);
+  json += ",\"connects\":" + String(net_connects);
+  json += ",\"reuses\":" + String(net_reuses);
+  json += ",\"connect_us\":" + String(net_connect_micros) + "}";
+  server.send(200, "application/json", json);
+}
+
+//Per NTP server: last round trip and offset against our clock (ms), replies/requests and whether it set the clock last
+void Web_get_ntp()
+{
+  String json = "[";
+  for (int i = 0; i < NTP_SERVERS; i++)
+  {
+    const NTPServer &ntp = ntp_servers[i];
+    json += (i > 0) ? ",{" : "{";
+    json += "\"server\":\"" + String(ntp.name) + "\"";
+    json += ",\"rtt\":" + String(ntp.answered ? ntp.delay_ms : -1);
+    json += ",\"offset\":" + String(ntp.offset_ms);
+    json += ",\"average_rtt\":" + String(ntp.replies > 0 ? ntp.delay_total_ms / ntp.replies : 0);
+    json += ",\"replies\":" + String(ntp.replies);
+    json += ",\"requests\":" + String(ntp.requests);
+    json += ",\"used\":" + String(i == ntp_chosen ? "true" : "false") + "}";
+  }
+  json += "]";
+  server.send(200, "application/json", json);
+}
+
+//PUT /file?name=/mode.txt with the file as the body, for when FTP isn't handy.  /restart.txt isn't stored, it asks for a
+//restart; anything else asks for a settings reload so a text settings file is read straight away.  As FTP_transfer()
+void Web_put_file()
+{
+  if (!Web_authorised())
+  {
+    return;
+  }
+  const size_t max_size = 4096;
+  String name = server.arg("name");
+  if (!name.startsWith("/") || name.length() > 31 || name == configfilename)
+  {
+    Web_send_error(400, "name");
+    return;
+  }
+  if (name == restartfilename)
+  {
+    Restart_request("PUT /file");
+    server.send(200, "application/json", "{\"restart\":true}");
+    return;
+  }
+  const String &body = server.arg("plain");
+  if (body.length() > max_size)
+  {
+    Web_send_error(400, "size");
+    return;
+  }
+
+  File f = Storage.open(name, "w");
+  if (!f)
+  {
+    Web_send_error(500, "open");
+    return;
+  }
+  size_t written = f.write((const uint8_t *)body.c_str(), body.length());
+  f.close();
+
+  Reload_request("PUT /file");
+  server.send(200, "application/json", "{\"name\":\"" + name + "\",\"size\":" + String(written) + "}");
+}
+
+//An FTP upload has finished.  /restart.txt asks for a restart, anything else a settings reload, as Web_put_file()
+void FTP_transfer(FtpTransferOperation operation, const char *name, unsigned int size)
+{
+  if (operation != FTP_UPLOAD_STOP)
+  {
+    return;
+  }
+  if (String(name).endsWith(restartfilename.substring(1)))
+  {
+    Storage.remove(restartfilename);
+    Restart_request("FTP");
+  }
+  else
+  {
+    Reload_request("FTP");
+  }
+}
+
+//Local control API on port 80.  /config, /restart, /reload and /file need the WiFi login (Web_authorised()), the rest are read only
+void Web_begin()
+{
+  server.on("/config", HTTP_GET, Web_get_config);
+  server.on("/config", HTTP_POST, Web_post_config);
+  server.on("/restart", HTTP_POST, Web_post_restart);
+  server.on("/reload", HTTP_POST, Web_post_reload);
+  server.on("/sunrise", HTTP_GET, Web_get_sunrise);
+  server.on("/net", HTTP_GET, Web_get_net);
+  server.on("/ntp", HTTP_GET, Web_get_ntp);
+  server.on("/pressure", HTTP_GET, Web_get_pressure);
+  server.on("/file", HTTP_PUT, Web_put_file);
+  server.onNotFound([]() { Web_send_error(404, "not found"); });
+  server.begin();
+}
+
+//Check if reset button pressed.  D3 / GPIO0 held to ground.
+void checkreset(int ClearSPIFFS)
+{
+  if (digitalRead(0) == 0 || ClearSPIFFS == 1)
+  {
+    delay(500); //500ms for button bounce
+    if (digitalRead(0) == 0 || ClearSPIFFS == 1)
+    {
+
+      //LEDs off
+      fill_solid(leds, NUM_LEDS_PER_STRIP, CRGB(0, 0, 0));
+      FastLED.setBrightness(255);
+      FastLED.show();
+
+      Serial.println("** RESET **");
+      Serial.println("** RESET **");
+      Serial.println("** RESET **");
+
+      Storage.remove(HTTPfilename);
+      Storage.remove(modefilename);
+      Storage.remove(UTCfilename);
+      Storage.remove(chimefilename);
+      Storage.remove(configfilename);
+      //Storage.remove(alarmfilename);
+      Storage.format();
+      RTC_clear();
+      WiFi.disconnect();
+
+      delay(2500);
+      ESP.restart();
     }
+  }
+}
+//Sunrise API refresh.  Keeps today's times (local date) no older than APISecondstowait, and gets tomorrow's just
+//before local midnight.  Failures retry after 1, 2, 4... minutes up to api_retry_max_seconds
+void API_check()
+{
+  if (sunrise_api_check == false)
+  {
+    return;
+  }
 
-    Serial.print(minute_UTC);
-    Serial.print(" ");
-    Serial.println(AMPM);
+  //First time: a random start so lamps powered up together are spread out
+  if (api_scheduled == false)
+  {
+    api_scheduled = true;
+    api_wait_millis = random(api_jitter_seconds) * 1000UL;
+    api_next_millis = millis();
+  }
 
-    Serial.println();
+  if (millis() - api_next_millis < api_wait_millis || flash_phase != 0) //Don't go to sunride API during flash phase as it causes flicker)
+  {
+    return;
+  }
+
+  uint32_t local_time = epoch + (localUTC + UTCoffset) * 3600;
+  uint32_t local_day = local_time / 86400;
+  uint32_t seconds_left = 86400 - local_time % 86400; //Until local midnight
+  uint32_t want_day = (seconds_left <= api_prefetch_seconds) ? local_day + 1 : local_day;
+  uint32_t wait_seconds;
+
+  bool good = true;
+  if (api_day != want_day || epoch - api_fetched_time > (uint32_t)APISecondstowait)
+  {
+    good = API_Request(want_day); //get sunrise/sunset data
+  }
+
+  if (good)
+  {
+    api_failures = 0;
+    if (want_day != local_day)
+    {
+      wait_seconds = seconds_left; //Got tomorrow, next look is after midnight
+    }
+    else
+    {
+      wait_seconds = min((uint32_t)APISecondstowait, seconds_left - api_prefetch_seconds);
+    }
+    wait_seconds += random(api_jitter_seconds);
+  }
+  else
+  {
+    api_failures++;
+    api_request_failures++;
+    wait_seconds = api_retry_seconds << min(api_failures - 1, 10);
+    wait_seconds = min(wait_seconds, api_retry_max_seconds);
+    wait_seconds = wait_seconds / 2 + random(wait_seconds / 2 + 1); //Jitter: somewhere in the second half
+    Serial.print("Sunrise API failed ");
+    Serial.print(api_failures);
+    Serial.print(" times in a row, retry in (s) ");
+    Serial.println(wait_seconds);
+  }
+
+  api_next_millis = millis();
+  api_wait_millis = wait_seconds * 1000UL;
+  yield();
+}
+
+//Seconds since the held API times were got.  -1 if there aren't any (or they're past api_valid_seconds)
+long API_stale_seconds()
+{
+  if (api_day == 0 || epoch - api_fetched_time > api_valid_seconds)
+  {
+    return -1;
+  }
+  return epoch - api_fetched_time;
+}
+
+//Compare the held API times with the local ones, if they're for the same day.  The sun for UTC day D has its noon on
+//local date D (offsets are within 12 hours), so a local date and solar_day line up
+void API_compare()
+{
+  if (API_stale_seconds() < 0 || api_day != solar_day || api_sunrise_minutes < 0 || api_sunset_minutes < 0)
+  {
+    return;
+  }
+  Serial.print("API - local sunrise, sunset (minutes): ");
+  Serial.print(api_sunrise_minutes - sunrise_minutes_from_midnight);
+  Serial.print(", ");
+  Serial.println(api_sunset_minutes - sunset_minutes_from_midnight);
+}
+
+//Note the heap if it's the lowest yet in this API request
+void API_heap_sample()
+{
+  api_heap_lowest = min(api_heap_lowest, ESP.getFreeHeap());
+  api_block_lowest = min(api_block_lowest, (uint32_t)ESP.getMaxFreeBlockSize());
+}
+
+// Get data from Sunrise API HTTP address, for a local date (days since 1970).  True if the times were got.  Reports the
+//heap used whichever way API_fetch() returns
+bool API_Request(uint32_t local_day)
+{
+  uint32_t heap_before = ESP.getFreeHeap();
+  uint32_t block_before = ESP.getMaxFreeBlockSize();
+  api_heap_lowest = heap_before;
+  api_block_lowest = block_before;
+
+  bool good = API_fetch(local_day);
+  API_heap_sample();
+
+  Serial.print("API request heap (bytes) free before ");
+  Serial.print(heap_before);
+  Serial.print(", most used ");
+  Serial.print(heap_before - api_heap_lowest);
+  Serial.print(", largest block before ");
+  Serial.print(block_before);
+  Serial.print(", smallest largest block ");
+  Serial.println(api_block_lowest);
+  return good;
+}
+
+//The request itself, for API_Request()
+bool API_fetch(uint32_t local_day)
+{
+  NetBody body;
+  bool good = false;
+  char request[120];
+  time_t date = local_day * 86400UL;
+
+  snprintf(request, sizeof(request), "%s&date=%04d-%02d-%02d", sunrise_api_request, year(date), month(date), day(date));
+  api_requests++;
+
+  Serial.println();
+  Serial.println("****************");
+  Serial.println();
+ 
+  Serial.print("Getting Sunrise API data with: ");
+  Serial.println(request);
+  int httpCode = Net_get(request, body); //Reuses the connection and address from last time if it can
+  API_heap_sample();
+  if (httpCode > 0)                      // httpCode will be negative on error
+  {
+    if (httpCode == 200)
+    {
+      //One pass straight off the connection into a fixed buffer on the stack, no copies of the body on the heap
+      StaticJsonBuffer<sunrise_json_size> jsonBuffer;
+      JsonObject &root = jsonBuffer.parseObject(body);
+      API_heap_sample();
+      if (!root.success())
+      {
+        Serial.println("API response parse failed");
+        Net_end(body);
+        return false;
+      }
+      Serial.println("API response received");
+      Serial.println();
+
+      JsonObject &results = root["results"];
+      int api_sunrise = API_iso_minutes(results["sunrise"]); //UTC minutes from midnight, -1 if it didn't make sense
+      int api_sunset = API_iso_minutes(results["sunset"]);
+
+      Serial.print("API sunrise = ");
+      Serial.print(api_sunrise);
+      Serial.print(",   sunset = ");
+      Serial.println(api_sunset);
+
+      //Only a cross check now, the times used come from Solar_calc().  Compared now if they're for today, else when
+      //the day comes round
+      if (api_sunrise >= 0 && api_sunset >= 0)
+      {
+        api_day = local_day;
+        api_fetched_time = epoch;
+        api_sunrise_minutes = api_sunrise;
+        api_sunset_minutes = api_sunset;
+        good = true;
+        API_compare();
+      }
+      Serial.println();
+      Serial.println("****************");
+      Serial.println();
+    }
+  }
+  else
+  {
+    Serial.println("[HTTP] GET... failed");
+  }
+  Net_end(body);
+  return good;
+}
+
+//***************************************************************************************************
+//Outbound network.  Host addresses are cached (NTP and HTTP) and HTTP/1.1 connections are kept alive, so a
+//repeat request is one round trip instead of DNS + TCP connect + request
+//***************************************************************************************************
+
+//Address of host, from the cache if it was looked up less than net_dns_ttl ago
+bool Net_resolve(const char *host, IPAddress &address)
+{
+  int oldest = 0;
+  for (int i = 0; i < NET_DNS_ENTRIES; i++)
+  {
+    if (strcmp(net_dns[i].host, host) == 0 && millis() - net_dns[i].resolved_millis < net_dns_ttl)
+    {
+      address = net_dns[i].address;
+      net_dns_hits++;
+      return true;
+    }
+    if (net_dns[i].host[0] == 0 || (net_dns[oldest].host[0] != 0 && net_dns[i].resolved_millis < net_dns[oldest].resolved_millis))
+    {
+      oldest = i;
+    }
+  }
+
+  uint32_t start_micros = micros();
+  bool good = WiFi.hostByName(host, address) == 1;
+  net_dns_micros = micros() - start_micros;
+  net_dns_lookups++;
+  if (!good)
+  {
+    Serial.print("DNS lookup failed: ");
+    Serial.println(host);
+    return false;
+  }
+
+  strncpy(net_dns[oldest].host, host, NET_HOST_SIZE - 1);
+  net_dns[oldest].host[NET_HOST_SIZE - 1] = 0;
+  net_dns[oldest].address = address;
+  net_dns[oldest].resolved_millis = millis();
+  return true;
+}
+
+//GET an http:// url.  Returns the status code (body is then at the start of the reply body) or -1.  Always follow with
+//Net_end(body)
+int Net_get(const char *url, NetBody &body)
+{
+  body.begin(NULL, 0, false);
+  if (strncmp(url, "http://", 7) != 0)
+  {
+    return -1;
+  }
+
+  //Split the url into host, port and path
+  char host[NET_HOST_SIZE];
+  const char *host_start = url + 7;
+  size_t host_length = strcspn(host_start, ":/");
+  if (host_length == 0 || host_length >= NET_HOST_SIZE)
+  {
+    return -1;
+  }
+  memcpy(host, host_start, host_length);
+  host[host_length] = 0;
+  uint16_t port = (host_start[host_length] == ':') ? atoi(host_start + host_length + 1) : 80;
+  const char *path = strchr(host_start, '/');
+  if (path == NULL)
+  {
+    path = "/";
+  }
+
+  //The connection to this host if there is one, else the least recently used
+  NetConnection *connection = &net_connections[0];
+  for (int i = 0; i < NET_CONNECTIONS; i++)
+  {
+    if (strcmp(net_connections[i].host, host) == 0 && net_connections[i].port == port)
+    {
+      connection = &net_connections[i];
+      break;
+    }
+    if (net_connections[i].used_millis < connection->used_millis)
+    {
+      connection = &net_connections[i];
+    }
+  }
+
+  //Twice: a kept-alive connection may have been closed by the server since it was last used
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    WiFiClient &client = connection->client;
+    bool same_host = (strcmp(connection->host, host) == 0 && connection->port == port);
+
+    if (same_host && attempt == 0 && client.connected())
+    {
+      net_reuses++;
+    }
+    else
+    {
+      IPAddress address;
+      client.stop();
+      connection->host[0] = 0;
+      if (!Net_resolve(host, address))
+      {
+        return -1;
+      }
+      uint32_t start_micros = micros();
+      if (!client.connect(address, port))
+      {
+        Serial.print("Connect failed: ");
+        Serial.println(host);
+        return -1;
+      }
+      net_connect_micros = micros() - start_micros;
+      net_connects++;
+      client.setNoDelay(true);
+      strcpy(connection->host, host);
+      connection->port = port;
+    }
+    connection->used_millis = millis();
+
+    client.printf("GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n", path, host);
+
+    //Status line, e.g. "HTTP/1.1 200 OK"
+    char line[80];
+    client.setTimeout(net_timeout);
+    size_t length = client.readBytesUntil('\n', line, sizeof(line) - 1);
+    line[length] = 0;
+    if (length < 12 || strncmp(line, "HTTP/1.", 7) != 0)
+    {
+      client.stop();
+      connection->host[0] = 0;
+      continue; //Nothing back, try a new connection
+    }
+    int status = atoi(line + 9);
+
+    //Headers, up to the blank line
+    long content_length = -1;
+    bool chunked = false;
+    bool close = false;
+    while (true)
+    {
+      length = client.readBytesUntil('\n', line, sizeof(line) - 1);
+      line[length] = 0;
+      if (length <= 1)
+      {
+        break;
+      }
+      if (strncasecmp(line, "Content-Length:", 15) == 0)
+      {
+        content_length = atol(line + 15);
+      }
+      if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strstr(line, "chunked") != NULL)
+      {
+        chunked = true;
+      }
+      if (strncasecmp(line, "Connection:", 11) == 0 && strstr(line, "close") != NULL)
+      {
+        close = true;
+      }
+    }
+
+    body.begin(&client, content_length, chunked);
+    if (close)
+    {
+      connection->host[0] = 0; //Don't use it again
+    }
+    return status;
+  }
+  return -1;
+}
+
+//Done with a reply.  The rest of the body is read off so the connection can carry the next request, or it's closed.
+//It's also closed when the server said Connection: close (Net_get() cleared the host)
+void Net_end(NetBody &body)
+{
+  if (body.client == NULL)
+  {
+    return;
+  }
+  bool finished = body.finish();
+  for (int i = 0; i < NET_CONNECTIONS; i++)
+  {
+    if (&net_connections[i].client == body.client)
+    {
+      if (!finished)
+      {
+        net_connections[i].host[0] = 0;
+      }
+      if (net_connections[i].host[0] == 0)
+      {
+        body.client->stop();
+      }
+    }
+  }
+  body.client = NULL;
+}
+
+//Read the Geiger counter on the local network, keeping its connection open between reads
+void Geiger_check()
+{
+  if (geiger_enabled == false || millis() - geiger_millis < geiger_interval)
+  {
+    return;
+  }
+  geiger_millis = millis();
+
+  NetBody body;
+  if (Net_get(geiger, body) == 200)
+  {
+    geigerresponse = "";
+    while (geigerresponse.length() < 256)
+    {
+      int c = body.read();
+      if (c < 0)
+      {
+        break;
+      }
+      geigerresponse += (char)c;
+    }
+  }
+  Net_end(body);
+}
+
+//***************************************************************************************************
+//Sun.  NOAA solar position for the stored latitude/longitude.  A year of it is worked out once into a
+//table in flash (when the place or the year changes), after that each day is one read from the table.
+//All times are UTC minutes from midnight, float32 throughout (no FPU, doubles are much slower)
+//***************************************************************************************************
+
+//Rise/set times for the sun's centre at zenith_deg.  False if it doesn't get there today (polar day/night),
+//then rise/set are both solar noon if it's below all day, or 0 / 1440 if it's above all day
+bool Solar_event(float zenith_deg, float &rise, float &set)
+{
+  float hour_angle_cos = (cosf(zenith_deg * SOLAR_DEG_TO_RAD) / (cosf(latitude * SOLAR_DEG_TO_RAD) * cosf(solar_declination)) -
+                          tanf(latitude * SOLAR_DEG_TO_RAD) * tanf(solar_declination));
+
+  if (hour_angle_cos > 1)
+  {
+    rise = solar_noon; //Never gets up this far
+    set = solar_noon;
+    return false;
+  }
+  if (hour_angle_cos < -1)
+  {
+    rise = 0; //Never gets down this far
+    set = 1440;
+    return false;
+  }
+
+  float hour_angle = acosf(hour_angle_cos) * SOLAR_RAD_TO_DEG;
+  rise = solar_noon - 4 * hour_angle;
+  set = solar_noon + 4 * hour_angle;
+  return true;
+}
+
+//The full sums for one UTC day (days since 1970) into the solar_ values
+void Solar_compute(uint32_t day)
+{
+  //Julian centuries since J2000.  Days counted as an integer first so float keeps the precision
+  float t = (float)((int32_t)day - 10957) / 36525.0f; //Day 10957 = 1 Jan 2000
+
+  float mean_longitude = fmodf(280.46646f + t * (36000.76983f + t * 0.0003032f), 360.0f);
+  float mean_anomaly = (357.52911f + t * (35999.05029f - 0.0001537f * t)) * SOLAR_DEG_TO_RAD;
+  float eccentricity = 0.016708634f - t * (0.000042037f + 0.0000001267f * t);
+  float centre = sinf(mean_anomaly) * (1.914602f - t * (0.004817f + 0.000014f * t)) + sinf(2 * mean_anomaly) * (0.019993f - 0.000101f * t) +
+                 sinf(3 * mean_anomaly) * 0.000289f;
+  float omega = (125.04f - 1934.136f * t) * SOLAR_DEG_TO_RAD;
+  float apparent_longitude = (mean_longitude + centre - 0.00569f - 0.00478f * sinf(omega)) * SOLAR_DEG_TO_RAD;
+  float obliquity = (23.0f + (26.0f + (21.448f - t * (46.815f + t * (0.00059f - t * 0.001813f))) / 60.0f) / 60.0f + 0.00256f * cosf(omega)) * SOLAR_DEG_TO_RAD;
+
+  solar_declination = asinf(sinf(obliquity) * sinf(apparent_longitude));
+
+  //Equation of time (minutes)
+  float y = tanf(obliquity / 2);
+  y *= y;
+  float L0 = mean_longitude * SOLAR_DEG_TO_RAD;
+  float equation_of_time = 4 * SOLAR_RAD_TO_DEG * (y * sinf(2 * L0) - 2 * eccentricity * sinf(mean_anomaly) + 4 * eccentricity * y * sinf(mean_anomaly) * cosf(2 * L0) -
+                                             0.5f * y * y * sinf(4 * L0) - 1.25f * eccentricity * eccentricity * sinf(2 * mean_anomaly));
+
+  solar_noon = 720 - 4 * longitude - equation_of_time;
+
+  Solar_event(90.833f, solar_sunrise, solar_sunset); //Top of the sun on the horizon, with refraction
+  Solar_event(96.0f, civil_dawn, civil_dusk);
+  Solar_event(102.0f, nautical_dawn, nautical_dusk);
+}
+
+//Days since 1970 of 1 January.  Every 4th year is a leap year up to 2099
+uint32_t Sun_year_first_day(int year)
+{
+  return 365UL * (year - 1970) + (year - 1969) / 4;
+}
+
+//Is the flash table for this year and the stored place, and all there
+bool Sun_table_valid(int year)
+{
+  const SunTableHeader *header = (const SunTableHeader *)sun_flash;
+
+  if (!flash_reserved_ok || header->magic != SUN_MAGIC || header->year != (uint32_t)year || header->latitude != latitude || header->longitude != longitude ||
+      header->days > SUN_DAYS)
+  {
+    return false;
+  }
+  //CRC 32 bits at a time, mapped flash only allows aligned 32 bit reads
+  const uint32_t *words = (const uint32_t *)sun_flash_days;
+  uint32_t crc = 0;
+  for (uint32_t i = 0; i < header->days * sizeof(SunDay) / 4; i++)
+  {
+    uint32_t word = words[i];
+    crc = crc32_calc((const uint8_t *)&word, 4, crc);
   }
+  return crc == header->crc;
 }
 
-//Calculate LED colours phases on the phase of the sun using sunrise API data and NTP time converted to local time (using UTC offset)
-void nightday_DoTheLEDs()
+//Start building the flash table for year.  The work is done a slice at a time by Sun_table_step() from loop(), so no
+//single pass is held up; Solar_calc() uses the full sums until the table is ready
+void Sun_table_build(int year)
 {
-  if (verbose_output == 1)
+  if (!flash_reserved_ok)
   {
-    // Serial.print("UTC Hour: ");
-    // Serial.print(hour);
-    // Serial.print(",   Minute: ");
-    // Serial.print(minute);
-    // Serial.print(",   Second: ");
-    // Serial.print(second);
-    // Serial.print(",   clock_AMPM: ");
-    // Serial.println(clock_AMPM);
-    // Serial.println();
+    return;
   }
-  //Check for sunrise.  clock_minutes_from_midnight is time in minutes from midnight.  Sunrise/set minutes and clock are both UTC
-  //Only compare UTC with UTC as local time (using UTC offset can change with daylight savings).  Local only for figuring out if it's night or day
-
-  //Corrected Sunrise/Set and time variables
-  int sunrise_minutes_from_midnight_corrected = sunrise_minutes_from_midnight;
-  int sunset_minutes_from_midnight_corrected = sunset_minutes_from_midnight;
-  int clock_minutes_from_midnight_corrected = clock_minutes_from_midnight;
+  sun_build_year = year;
+  sun_build_tried = year;
+  sun_build_next = -SUN_SECTORS;
+  sun_build_crc = 0;
+  sun_build_micros = 0;
+}
 
-  //e.g SR 0020 means 30mins before and 30 after would be 1430:0050.  Different timelines are difficult to compare.  Make 0020 = 1460 (1440 + 0020) then 30mins before/after:  1430:1490
-  //Need to correct time
-  if (sunrise_minutes_from_midnight < (minswithin / 2))
+//One slice of a sun table build: erase a sector, or work out and write SUN_BUILD_SLICE days.  The header goes last, so a
+//table cut short by a restart is never taken as good
+void Sun_table_step()
+{
+  if (sun_build_year == 0)
   {
-    sunrise_minutes_from_midnight_corrected = sunrise_minutes_from_midnight + 1440;
+    return;
+  }
 
-    //if Sunrise corrected then correct time is also in the same way
-    if (clock_minutes_from_midnight < (minswithin / 2))
-    {
-      clock_minutes_from_midnight_corrected = clock_minutes_from_midnight + 1440;
+  uint32_t start_micros = micros();
+  uint32_t first_day = Sun_year_first_day(sun_build_year);
+  int days = Sun_year_first_day(sun_build_year + 1) - first_day;
+  bool good = true;
 
-      Serial.println("*sunrise period spans midnight UTC - corrected");
-    }
+  if (sun_build_next < 0)
+  {
+    good = ESP.flashEraseSector(SUN_FLASH_START / SPI_FLASH_SEC_SIZE + SUN_SECTORS + sun_build_next);
+    sun_build_next++;
   }
-
-  if (sunset_minutes_from_midnight < (minswithin / 2))
+  else if (sun_build_next < days)
   {
-    sunset_minutes_from_midnight_corrected = sunset_minutes_from_midnight + 1440;
-
-    //if Sunrise corrected then correct time is also in the same way
-    if (clock_minutes_from_midnight < (minswithin / 2))
+    //Solar_compute() works in the solar_ values the lamp is using, so they're put back after
+    float in_use[] = {solar_sunrise, solar_sunset, civil_dawn, civil_dusk, nautical_dawn, nautical_dusk, solar_noon, solar_declination};
+    SunDay entries[SUN_BUILD_SLICE];
+    int count = min(SUN_BUILD_SLICE, days - sun_build_next);
+    for (int i = 0; i < count; i++)
     {
-      clock_minutes_from_midnight_corrected = clock_minutes_from_midnight + 1440;
-
-      Serial.println("*sunset period spans midnight UTC - corrected");
+      Solar_compute(first_day + sun_build_next + i);
+
+      SunDay &entry = entries[i];
+      entry.sunrise = (int16_t)roundf(solar_sunrise * 10);
+      entry.sunset = (int16_t)roundf(solar_sunset * 10);
+      entry.civil_dawn = (int16_t)roundf(civil_dawn * 10);
+      entry.civil_dusk = (int16_t)roundf(civil_dusk * 10);
+      entry.nautical_dawn = (int16_t)roundf(nautical_dawn * 10);
+      entry.nautical_dusk = (int16_t)roundf(nautical_dusk * 10);
+      entry.noon = (int16_t)roundf(solar_noon * 10);
+      entry.declination = (int16_t)roundf(solar_declination * 10000);
     }
+    solar_sunrise = in_use[0];
+    solar_sunset = in_use[1];
+    civil_dawn = in_use[2];
+    civil_dusk = in_use[3];
+    nautical_dawn = in_use[4];
+    nautical_dusk = in_use[5];
+    solar_noon = in_use[6];
+    solar_declination = in_use[7];
+    sun_build_crc = crc32_calc((const uint8_t *)entries, count * sizeof(SunDay), sun_build_crc);
+    good = ESP.flashWrite(SUN_FLASH_START + sizeof(SunTableHeader) + sun_build_next * sizeof(SunDay), (uint32_t *)entries,
+                          count * sizeof(SunDay));
+    sun_build_next += count;
   }
-
-  //Check for Sunrise phase
-  if (clock_minutes_from_midnight_corrected >= (sunrise_minutes_from_midnight_corrected - (minswithin / 2)) && clock_minutes_from_midnight_corrected <= (sunrise_minutes_from_midnight_corrected + (minswithin / 2)))
+  else
+  {
+    SunTableHeader header;
+    header.magic = SUN_MAGIC;
+    header.year = sun_build_year;
+    header.latitude = latitude;
+    header.longitude = longitude;
+    header.days = days;
+    header.crc = sun_build_crc;
+    good = ESP.flashWrite(SUN_FLASH_START, (uint32_t *)&header, sizeof(header));
+  }
+  sun_build_micros += micros() - start_micros;
+
+  if (!good || sun_build_next > days)
   {
-    SR_Phase = 1;
-    LED_phase = ((clock_minutes_from_midnight_corrected - sunrise_minutes_from_midnight_corrected) + (minswithin / 2)) / (float)minswithin * 255;
+    Serial.print(good ? "Sun table built for " : "Sun table write failed for ");
+    Serial.print(sun_build_year);
+    Serial.print(", took (us) ");
+    Serial.println(sun_build_micros);
+    sun_build_year = 0;
   }
-  else
+  else if (sun_build_next == days)
   {
-    SR_Phase = 0;
+    sun_build_next++; //Header next pass
   }
+}
 
-  //Check for sunset.  clock_minutes_from_midnight is time in minutes from midnight.  Sunrise/set minutes is LOCAL time from API
-  if (clock_minutes_from_midnight_corrected >= (sunset_minutes_from_midnight_corrected - (minswithin / 2)) && clock_minutes_from_midnight_corrected <= (sunset_minutes_from_midnight_corrected + (minswithin / 2)))
+//Sun for the UTC day holding time.  Once a day, one read from the flash table.  If the table isn't for this year and
+//place a build is started and the full sums are used until it's done
+void Solar_calc(uint32_t time)
+{
+  uint32_t day = time / 86400;
+  if (day == solar_day && solar_valid == true)
   {
-    SS_Phase = 1;
-    LED_phase = ((clock_minutes_from_midnight_corrected - sunset_minutes_from_midnight_corrected) + (minswithin / 2)) / (float)minswithin * 255;
+    return;
   }
-  else
+
+  int this_year = year(time);
+  if (sun_table_year != this_year)
   {
-    SS_Phase = 0;
+    sun_table_year = Sun_table_valid(this_year) ? this_year : 0;
+    if (sun_table_year == 0 && sun_build_year == 0 && sun_build_tried != this_year)
+    {
+      Sun_table_build(this_year);
+    }
   }
 
-  //if it's not in sunrise or sunset sequence then find out if it's day (yellow) or night (blue) and set colour
-  //Using Local UTC (don't care about daylight saving) for day or night
-  if (local_clock_minutes_from_midnight > local_sunrise_minutes_from_midnight && local_clock_minutes_from_midnight < local_sunset_minutes_from_midnight)
+  uint32_t start_cycles = ESP.getCycleCount();
+
+  if (sun_table_year == this_year)
   {
-    night = 0;
+    SunDay entry;
+    memcpy_P(&entry, &sun_flash_days[day - Sun_year_first_day(this_year)], sizeof(entry));
+    solar_sunrise = entry.sunrise / 10.0f;
+    solar_sunset = entry.sunset / 10.0f;
+    civil_dawn = entry.civil_dawn / 10.0f;
+    civil_dusk = entry.civil_dusk / 10.0f;
+    nautical_dawn = entry.nautical_dawn / 10.0f;
+    nautical_dusk = entry.nautical_dusk / 10.0f;
+    solar_noon = entry.noon / 10.0f;
+    solar_declination = entry.declination / 10000.0f;
   }
   else
   {
-    night = 1;
+    Solar_compute(day);
   }
 
-  if (verbose_output == 1)
-  {
-
-    Serial.print("clock_minutes_from_midnight (UTC) = ");
-    Serial.print(clock_minutes_from_midnight);
-    Serial.print(",   local_clock_minutes_from_midnight = ");
-    Serial.println(local_clock_minutes_from_midnight);
-    Serial.print("sunrise minutes_from_midnight (UTC) = ");
-    Serial.print(sunrise_minutes_from_midnight);
-    Serial.print(",   sunset_minutes_from_midnight (UTC) = ");
-    Serial.println(sunset_minutes_from_midnight);
-    Serial.print("Seconds_SinceLast_NTP_millis: ");
-    Serial.print(Seconds_SinceLast_NTP_millis);
-    Serial.print(",   Startmillis: ");
-    Serial.print(startmillis);
-    Serial.print(",   epochstart: ");
-    Serial.print("SecondsSinceLastAPI: ");
-    Serial.print(SecondsSinceLastAPI);
-    Serial.println(epochstart);
-    Serial.println();
-    Serial.print("flash_phase = ");
-    Serial.print(flash_phase);
-    Serial.print(",   night = ");
-    Serial.print(night);
-    Serial.print(",   Sunrise phase = ");
-    Serial.print(SR_Phase);
-    Serial.print(",   Sunset phase = ");
-    Serial.println(SS_Phase);
-    Serial.print("Mins to Sunset phase = ");
-    Serial.print(sunset_minutes_from_midnight - clock_minutes_from_midnight - int(minswithin / 2));
-    Serial.print(",   Mins to Sunrise phase = ");
-    Serial.print(sunrise_minutes_from_midnight - clock_minutes_from_midnight - int(minswithin / 2));
-    Serial.print(", retryNTP = ");
-    Serial.println(retryNTP);
-  }
+  solar_cycles = ESP.getCycleCount() - start_cycles;
+  solar_day = day;
+  solar_valid = true;
+  Sky_build();
 
-  //call function to select LED colours for either all day/night or just nightlight
-  if (lightmode == 0)
+  //The rest of the lamp works in whole minutes, 0-1439
+  sunrise_minutes_from_midnight = ((int)roundf(solar_sunrise) + 1440) % 1440;
+  sunset_minutes_from_midnight = ((int)roundf(solar_sunset) + 1440) % 1440;
+  if (solar_sunset - solar_sunrise >= 1440)
   {
-    daynight();
-  }
+    sunset_minutes_from_midnight = sunrise_minutes_from_midnight + 1439; //Sun up all day
+  }
+  API_compare(); //If the API cross check has this day already (prefetched), against the new minutes
+
+  Serial.print("Sun (UTC minutes) nautical/civil dawn, sunrise, sunset, civil/nautical dusk: ");
+  Serial.print(nautical_dawn, 1);
+  Serial.print(" ");
+  Serial.print(civil_dawn, 1);
+  Serial.print(" ");
+  Serial.print(solar_sunrise, 1);
+  Serial.print(" ");
+  Serial.print(solar_sunset, 1);
+  Serial.print(" ");
+  Serial.print(civil_dusk, 1);
+  Serial.print(" ");
+  Serial.println(nautical_dusk, 1);
+  Serial.print(sun_table_year == this_year ? "Sun table read took (cycles) " : "Sun calculation took (cycles) ");
+  Serial.println(solar_cycles);
+}
 
-  if (lightmode == 1 || lightmode == 2)
+//Sunrise API time with formatted=0, ISO 8601 "2024-06-21T19:47:12+00:00", as UTC minutes from midnight.  Reads the
+//digits in place, no copies.  -1 if it isn't in that form
+int API_iso_minutes(const char *text)
+{
+  if (text == NULL || strlen(text) < 25 || text[10] != 'T' || text[13] != ':' || text[22] != ':')
   {
-    nightlight();
+    return -1;
   }
 
-  fill_solid(leds, NUM_LEDS_PER_STRIP, CRGB(red, green, blue));
-
-  //Set the top light:  0=Same as other LEDs, 1=Red, 2=Green, 3=Blue, 4=White
-  if (TARDIS == 1)
+  //Hour, minute, then the offset hours and minutes
+  const int positions[4] = {11, 14, 20, 23};
+  int values[4];
+  for (int i = 0; i < 4; i++)
   {
-    leds[NUM_LEDS_PER_STRIP - 1].setRGB(255, 0, 0); //Light on top of TARDIS Red
+    const char *digits = text + positions[i];
+    if (digits[0] < '0' || digits[0] > '9' || digits[1] < '0' || digits[1] > '9')
+    {
+      return -1;
+    }
+    values[i] = (digits[0] - '0') * 10 + (digits[1] - '0');
   }
 
-  if (TARDIS == 2)
+  int offset = values[2] * 60 + values[3];
+  if (text[19] == '-')
   {
-    leds[NUM_LEDS_PER_STRIP - 1].setRGB(0, 255, 0); //Light on top of TARDIS Green
+    offset = -offset;
   }
-
-  if (TARDIS == 3)
+  else if (text[19] != '+')
   {
-    leds[NUM_LEDS_PER_STRIP - 1].setRGB(0, 0, 255); //Light on top of TARDIS Blue
+    return -1;
   }
 
-  if (TARDIS == 4)
-  {
-    leds[NUM_LEDS_PER_STRIP - 1].setRGB(255, 255, 255); //Light on top of TARDIS White
-  }
+  return ((values[0] * 60 + values[1] - offset) % 1440 + 1440) % 1440;
+}
 
-  FastLED.setBrightness(brightness);
-  FastLED.show();
+//***************************************************************************************************
+//Settings.  One CRC checked ConfigRecord in /config.bin, read in a single go at boot.  The old four
+//text files are read once to move them over, then removed
+//***************************************************************************************************
 
-  if (verbose_output == 1)
+//Digit at text[index] as a number.  -1 if the text is too short or it isn't a digit (caught by Config_check)
+int Config_digit(const char *text, int index)
+{
+  for (int i = 0; i < index; i++)
   {
-    Serial.print("LED_phase = ");
-    Serial.print(LED_phase);
-    Serial.print(",   red = ");
-    Serial.print(red);
-    Serial.print(",   blue = ");
-    Serial.print(blue);
-    Serial.print(",   green = ");
-    Serial.println(green);
-    Serial.println();
-    Serial.println("********************************************************");
-    Serial.println();
-    Serial.print("Working mode = ");
-    Serial.print(working_mode);
-    
-    if (working_mode == true){
-      Serial.println(" : Night light mode");
-    }
-    else
+    if (text[i] == 0)
     {
-      Serial.println(" : Weather mode");
+      return -1;
     }
-    
-    Serial.println();
-    Serial.println("********************************************************");
-    Serial.println("");
   }
+  return (text[index] >= '0' && text[index] <= '9') ? text[index] - '0' : -1;
 }
 
-//daunight mode:  yellow during day, blue at night
-void daynight()
+//Fill config from the text settings (the defaults).  mode and chime are read by Config_merge_mode() and
+//Config_merge_chime(), the same as the text files and the portal page
+void Config_from_text(float lat, float lng, const char *mode_text, const char *utc_text, const char *chime_text)
+{
+  memset(&config, 0, sizeof(config));
+  config.magic = CONFIG_MAGIC;
+  config.version = CONFIG_VERSION;
+  config.size = sizeof(ConfigRecord);
+  config.latitude = lat;
+  config.longitude = lng;
+
+  //-1 = not given, Config_check() puts the default in
+  config.lightmode = config.TARDIS = config.flash = config.brightness = config.volume = -1;
+  Config_merge_mode(config, mode_text);
+
+  int utc = atoi(utc_text);
+  config.UTC = (utc < -99 || utc > 99) ? 99 : utc;
 
+  Config_merge_chime(config, chime_text);
+}
+
+//Header and CRC check, straight on the record as read
+bool Config_valid(const ConfigRecord &record)
 {
-  SRSS_Flip = 0; //0=Normal sunrise/sunset, 1=Inverted sunrise/sunset colour change order (only used in nightlight mode 1 & 2)
-  sunrise_sunset();
+  return record.magic == CONFIG_MAGIC && record.version == CONFIG_VERSION && record.size == sizeof(ConfigRecord) &&
+         record.crc == crc32_calc((const uint8_t *)&record, sizeof(record) - 4);
+}
 
-  //It's night and not in sunrise or sunset mode
-  if (SR_Phase == 0 && SS_Phase == 0 && night == 1)
+//Check the settings are in range and correct any that aren't
+void Config_check(ConfigRecord &record)
+{
+  //Check light mode is valid.
+  if (record.lightmode < 0 || record.lightmode > 2)
   {
-    blue = blue_night;
-    green = green_night;
-    red = red_night;
+    Serial.println("Light mode incorrect - overriding");
+    record.lightmode = 0;
   }
 
-  //It's day and not in sunrise or sunset mode
-  if (SR_Phase == 0 && SS_Phase == 0 && night == 0)
+  //Check Top light entry is valid
+  if (record.TARDIS < 0 || record.TARDIS > 4)
   {
-    blue = blue_day;
-    green = green_day;
-    red = red_day;
+    Serial.println("Top light incorrect - overriding");
+    record.TARDIS = 3;
   }
-}
 
-//nightlight mode:  Off during day, yellow during night
-void nightlight()
-{
-  SRSS_Flip = 1;    //1=Inverted sunrise/sunset colour change order
-  sunrise_sunset(); //calculate LEDs
-
-  //This section overrides the LED colours calculated from Sunrise/set phase.
+  //Check flash mode is valid.
+  if (record.flash < 0 || record.flash > 9)
+  {
+    Serial.println("Flash mode incorrect - overriding");
+    record.flash = 0;
+  }
 
-  //Mode 0:  This nightlight function should not be called in daynight mode (mode 0)
-  //Mode 1
-  if (SR_Phase == 0 && SS_Phase == 0 && lightmode == 1 && night == 1) //Not in Sunrise/set phase, I'm in mode 1 and it's night time - LEDs yellow
+  //Check brightness is valid.
+  if (record.brightness < 1 || record.brightness > 5)
   {
-    blue = blue_day;
-    green = green_day;
-    red = red_day;
+    Serial.println("Brightness incorrect - overriding");
+    record.brightness = 5;
   }
 
-  if (SR_Phase == 0 && SS_Phase == 0 && lightmode == 1 && night == 0) //Not in Sunrise/set phase, I'm in mode 1 and it's daytime - LEDs off
+  //The volume is used as a flag to run/no run sound functions in loop
+  if (record.volume < 0 || record.volume > 9)
   {
-    blue = 0;
-    green = 0;
-    red = 0;
+    Serial.println("mp3 volume incorrect - overriding");
+    record.volume = 0; //default to 0 in error state - no sound
   }
 
-  //Mode 2
-  if (lightmode == 2 && night == 0) //Don't care about in Sunrise/set phase, I'm in mode 2 and it's daytime - LEDs off
+  if (record.UTC < -13 || record.UTC > 13)
   {
-    blue = 0;
-    green = 0;
-    red = 0;
+    Serial.println("UTC mode incorrect - overriding");
+    record.UTC = 12; //Default to NZ (winter)
   }
 
-  if (lightmode == 2 && night == 1) //Don't care about Sunrise/set phase, I'm in mode 2 and it's night time - LEDs yellow
+  if (record.latitude < -90 || record.latitude > 90 || record.longitude < -180 || record.longitude > 180)
   {
-    blue = blue_day;
-    green = green_day;
-    red = red_day;
+    Serial.println("Latitude/Longitude incorrect - overriding");
+    record.latitude = -41.2865; //Default to Wellington
+    record.longitude = 174.7762;
   }
+
+  record.chime_mask &= 0xFFFFFF;
 }
 
-//Calculate sunrise/sunset LED colours
-void sunrise_sunset()
+//Copy the settings into the working variables
+void Config_apply()
 {
+  lightmode = config.lightmode;
+  TARDIS = config.TARDIS;
+  flash = config.flash;
+  localUTC = config.UTC;
+  latitude = config.latitude;
+  longitude = config.longitude;
+  chime_mask = config.chime_mask;
 
-  //This piece flips SR and SS phases if requested by use of SRSS_Flip (for nightlight)
-  int SR_Phase_use;
-  int SS_Phase_use;
+  //Entry x 5 +5 gives range of 55-255
+  brightness = (config.brightness * 50) + 5;
+  brightness1 = brightness;
 
-  if (SR_Phase == 1 && SRSS_Flip == 0)
-  {
-    SR_Phase_use = 1;
-    SS_Phase_use = 0;
+  mp3vol = config.volume * 3.3; //30 is max volume, 9 x 3.3 = 29.7
+  if (mp3vol >= 29)
+  { //29 is close enough to 30, make it 30
+    mp3vol = 30;
   }
 
-  if (SR_Phase == 1 && SRSS_Flip == 1)
-  {
-    SR_Phase_use = 0;
-    SS_Phase_use = 1;
-  }
+  //Example: sunrise_api_request = "http://api.sunrise-sunset.org/json?lat=-41.2865&lng=174.7762&formatted=0"
+  char lat_text[12], lng_text[12];
+  dtostrf(latitude, 1, 4, lat_text);
+  dtostrf(longitude, 1, 4, lng_text);
+  sprintf(sunrise_api_request, "http://api.sunrise-sunset.org/json?lat=%s&lng=%s&formatted=0", lat_text, lng_text);
+
+  Serial.print("Light mode used = ");
+  Serial.println(lightmode);
+  Serial.print("Top light used = ");
+  Serial.println(TARDIS);
+  Serial.print("Flash mode used = ");
+  Serial.println(flash);
+  Serial.print("Brightness (1-5) = ");
+  Serial.println(config.brightness);
+  Serial.print("mp3 Volume = ");
+  Serial.println(mp3vol);
+  Serial.print("UTC used = ");
+  Serial.println(localUTC);
+  Serial.print("Chime hours = ");
+  Serial.println(chime_mask, BIN);
+  Serial.printf("http adress for Sunrise/set API = %s\n", sunrise_api_request);
+}
 
-  if (SS_Phase == 1 && SRSS_Flip == 0)
+void Config_save()
+{
+  config.crc = crc32_calc((const uint8_t *)&config, sizeof(config) - 4);
+
+  File f = Storage.open(configfilename, "w");
+  if (!f)
   {
-    SR_Phase_use = 0;
-    SS_Phase_use = 1;
+    Serial.println("Config file open failed");
+    return;
   }
+  f.write((const uint8_t *)&config, sizeof(config));
+  f.close();
+  Serial.println("Config written");
+}
+
+//One read of /config.bin into record.  False if it isn't there or doesn't check out
+bool Config_load(ConfigRecord &record)
+{
+  uint32_t start_micros = micros();
 
-  if (SS_Phase == 1 && SRSS_Flip == 1)
+  File f = Storage.open(configfilename, "r");
+  if (!f)
   {
-    SR_Phase_use = 1;
-    SS_Phase_use = 0;
+    return false;
   }
+  bool good = (f.read((uint8_t *)&record, sizeof(record)) == sizeof(record) && Config_valid(record));
+  f.close();
 
-  if (verbose_output == 1)
+  config_load_micros = micros() - start_micros;
+  Serial.print("Config load took (us) ");
+  Serial.println(config_load_micros);
+  return good;
+}
+
+//Read a whole old text settings file into text (always 0 terminated)
+void Config_read_text(const String &filename, char *text, size_t size)
+{
+  text[0] = 0;
+  File f = Storage.open(filename, "r");
+  if (!f)
   {
-    Serial.print("SR_Phase_use = ");
-    Serial.print(SR_Phase_use);
-    Serial.print(",   SS_Phase_use = ");
-    Serial.println(SS_Phase_use);
-    Serial.println();
+    Serial.println("file open failed");
+    return;
   }
+  size_t length = f.readBytes(text, size - 1);
+  text[length] = 0;
+  f.close();
+}
 
-  //sunrise:  Start with blue reducing to zero, and red increasing, when blue 0 increase green
-  if (SR_Phase_use == 1 && blue >= 0)
+//mode text over record: 4 digits, light mode, top light, flash, brightness.  Only the digits that are there
+void Config_merge_mode(ConfigRecord &record, const char *text)
+{
+  int8_t *fields[4] = {&record.lightmode, &record.TARDIS, &record.flash, &record.brightness};
+  for (int i = 0; i < 4; i++)
   {
-    //in first part of sunrise (reduce blue / increase red)
-    blue = blue_max - (LED_phase * 2); //LED Phase 0-128,  *2 as in 1st phase we need 0-255 of LED movement for blue & red
-    red = 0 + (LED_phase * 2);
-
-    if (blue < 0)
-    {
-      blue = 0;
-    }
-    if (red > red_max)
+    int digit = Config_digit(text, i);
+    if (digit >= 0)
     {
-      red = red_max;
+      *fields[i] = digit;
     }
-    green = 0; //force in case lamp started during phase
   }
+}
 
-  if (SR_Phase_use == 1 && blue == 0)
+//chime text over record: volume digit, then the 24 hours if they're all there
+void Config_merge_chime(ConfigRecord &record, const char *text)
+{
+  if (Config_digit(text, 0) >= 0)
   {
-    //in second part of sunrise (increase green)
-    green = 0 + abs(LED_phase - 128); //LED Phase 128-255, need to be 0 to start green LED movement (0-128)
-
-    if (green > green_max)
+    record.volume = Config_digit(text, 0);
+  }
+  if (Config_digit(text, 24) >= 0)
+  {
+    record.chime_mask = 0;
+    for (int hour = 0; hour < 24; hour++)
     {
-      green = green_max;
+      if (Config_digit(text, hour + 1) == 1)
+      {
+        record.chime_mask |= 1UL << hour;
+      }
     }
   }
+}
 
-  //sunset:  Start with green reducing to zero, then reducing red to 0 and increasing blue
-  if (SS_Phase_use == 1 && green > 0)
-  {
-    green = green_max - (LED_phase); //LED Phase 0-128, reduce green from 128 > 0
+//Text settings files override what's in record, each file only the settings it holds.  These are the old settings
+//files (moved over to /config.bin the first time) or ones uploaded with PUT /file later.  mode = light mode, top light, flash,
+//brightness digits.  chime = volume digit then 24 digits (midnight first) 1 = chime.  The files are removed once read.
+//False if there weren't any
+bool Config_text_override(ConfigRecord &record)
+{
+  uint32_t start_micros = micros();
+  bool found = false;
+  char text[100];
 
-    if (green < 0)
+  //Latitude and longitude are only in the API address
+  if (Storage.exists(HTTPfilename))
+  {
+    Config_read_text(HTTPfilename, text, sizeof(text));
+    const char *lat = strstr(text, "lat=");
+    const char *lng = strstr(text, "lng=");
+    if (lat && lng)
     {
-      green = 0;
+      record.latitude = atof(lat + 4);
+      record.longitude = atof(lng + 4);
     }
-
-    blue = 0; //force in case lamp started during phase
+    Storage.remove(HTTPfilename);
+    found = true;
   }
 
-  if (SS_Phase_use == 1 && green == 0)
+  if (Storage.exists(modefilename))
   {
-    //in second part of sunset increase blue and rdecrease red
-    blue = 0 + (abs(LED_phase - 128) * 2);      //LED Phase 128-255, subtract 128 (gives range 0-128) then x2 (range 0-255)
-    red = red_max - (abs(LED_phase - 128) * 2); //LED Phase 128-255, subtract 128 (gives range 0-128) then x2 (range 0-255)
+    Config_read_text(modefilename, text, sizeof(text));
+    Config_merge_mode(record, text);
+    Storage.remove(modefilename);
+    found = true;
+  }
 
-    if (blue > blue_max)
+  if (Storage.exists(UTCfilename))
+  {
+    Config_read_text(UTCfilename, text, sizeof(text));
+    if (text[0] != 0)
     {
-      blue = blue_max;
+      record.UTC = constrain(atoi(text), -99, 99);
     }
+    Storage.remove(UTCfilename);
+    found = true;
+  }
 
-    if (red < 0)
-    {
-      red = 0;
-    }
+  if (Storage.exists(chimefilename))
+  {
+    Config_read_text(chimefilename, text, sizeof(text));
+    Config_merge_chime(record, text);
+    Storage.remove(chimefilename);
+    found = true;
+  }
+
+  if (found)
+  {
+    Serial.print("Settings read from text files, took (us) ");
+    Serial.println(micros() - start_micros);
   }
+  return found;
 }
-//Check if reset button pressed.  D3 / GPIO0 held to ground.
-void checkreset(int ClearSPIFFS)
+
+//Boot: settings from /config.bin, then any text settings files on top (the old ones are moved over once this way).
+//If neither WiFi_and_Credentials() asks
+void Config_begin()
 {
-  if (digitalRead(0) == 0 || ClearSPIFFS == 1)
+  config_loaded = Config_load(config);
+  if (config_loaded == false)
   {
-    delay(500); //500ms for button bounce
-    if (digitalRead(0) == 0 || ClearSPIFFS == 1)
-    {
+    //Nothing saved: defaults (Wellington) until the WiFi setup page is filled in, so the lamp can run offline
+    Config_from_text(999, 999, "", "99", "");
+  }
 
-      //LEDs off
-      fill_solid(leds, NUM_LEDS_PER_STRIP, CRGB(0, 0, 0));
-      FastLED.setBrightness(255);
-      FastLED.show();
+  if (Config_text_override(config))
+  {
+    config_loaded = true;
+    Config_check(config);
+    Config_save();
+  }
 
-      Serial.println("** RESET **");
-      Serial.println("** RESET **");
-      Serial.println("** RESET **");
+  //Check the settings and correct if needed (a saved record is already good), then use them
+  Config_check(config);
+  Config_apply();
+}
 
-      SPIFFS.remove(HTTPfilename);
-      SPIFFS.remove(modefilename);
-      SPIFFS.remove(UTCfilename);
-      SPIFFS.remove(chimefilename);
-      //SPIFFS.remove(alarmfilename);
-      SPIFFS.format();
-      WiFi.disconnect();
+//Connect to the WiFi and manage credentials.  Doesn't wait: WiFi_check() in loop() carries on from here, and opens the
+//setup portal straight away if there's no saved WiFi
+void WiFi_and_Credentials()
+{
+  //2 ways to get WiFi.  ConnectToAP uses variables from build flags (platformio) or hard coded.
+  //Otherwise the WiFi saved by the SDK is used, and the setup portal collects it from the user if there isn't one
 
-      delay(2500);
-      ESP.restart();
-    }
+  //Use one of the follow lines depending on approach (build flags vs setup portal)
+  //ConnectToAP();           //Connect to Wifi (if not using the setup portal approach)
+
+  if (config_loaded == false)
+  {
+    Serial.println("No saved settings, they can be entered on the setup portal page");
   }
-}
-void API_check()
-{
-  //Check if it's time to get Sunrise/Set times
-  SecondsSinceLastAPI = (millis() - LastAPI) / 1000;              //How many seconds since Last API pull
-  if (SecondsSinceLastAPI > APISecondstowait && flash_phase == 0) //Don't go to sunride API during flash phase as it causes flicker)
+
+  WiFi.mode(WIFI_STA);
+  if (WiFi.SSID() == "")
   {
-    LastAPI = millis();
-    API_Request(); //get sunrise/sunset data
-    yield();
+    Serial.println("No saved WiFi");
+    Portal_start();
+    return;
   }
+  WiFi.begin(); //The saved WiFi
+  wifi_connect_millis = millis();
 }
 
-// Get data from Sunrise API HTTP address
-void API_Request()
-
+//Run the setup portal until the WiFi is joined, then start everything that needs it
+void WiFi_check()
 {
-  HTTPClient http;
-  char buff[400];
-
-  Serial.println();
-  Serial.println("****************");
-  Serial.println();
- 
-  Serial.print("Getting Sunrise API data with: ");
-  Serial.println(sunrise_api_request);
-  http.begin(sunrise_api_request);
-
-  int httpCode = http.GET(); //Serial.print("[HTTP] GET...\n");  Start connection and send HTTP header
-  if (httpCode > 0)          // httpCode will be negative on error
+  if (wifi_online == true)
   {
-    // HTTP header has been send and Server response header has been handled
-    //Serial.printf("[HTTP] GET... code: %d\n", httpCode);
-    if (httpCode == HTTP_CODE_OK)
-    {
-      String payload = http.getString();
-      payload.toCharArray(buff, 400);
-      sunAPIresponse = payload; //Sunresponse is used by JSON function
-      Serial.println("API response received");
-      Serial.println();
-
-      sscanf(JSON_Extract("sunrise").c_str(), "%d:%d:%*d %c", &hour_sunrise, &minute_sunrise, SR_AMPM); //Get JSON for sunrise (string) convert to const char and search for hours:minutes
-      sscanf(JSON_Extract("sunset").c_str(), "%d:%d:%*d %c", &hour_sunset, &minute_sunset, SS_AMPM);    //Get JSON for sunset (string) convert to const char and search for hours:minutes
-
-      Serial.print("hour_sunrise = ");
-      Serial.print(hour_sunrise);
-      Serial.print(",   minute_sunrise = ");
-      Serial.print(minute_sunrise);
-      Serial.print(",   SR AMPM = ");
-      Serial.println(SR_AMPM);
-      Serial.print("hour_sunset = ");
-      Serial.print(hour_sunset);
-      Serial.print(",   minute_sunset = ");
-      Serial.print(minute_sunset);
-      Serial.print(",   SS AMPM = ");
-      Serial.println(SS_AMPM);
-      Serial.println();
-      Serial.println("****************");
-      Serial.println();
-    }
+    return;
   }
-  else
+
+  if (portal_open == true)
+  {
+    portal_dns.processNextRequest();
+    portal_server.handleClient();
+  }
+  if (WiFi.status() == WL_CONNECTED)
   {
-    Serial.printf("[HTTP] GET... failed, error: %s\n", http.errorToString(httpCode).c_str());
+    Portal_stop(); //Gives up port 80 for the local API
+    WiFi_online();
+  }
+  else if (portal_open == false && millis() - wifi_connect_millis > wifi_connect_timeout)
+  {
+    Serial.println("Saved WiFi not joined");
+    Portal_start();
   }
-  http.end();
 }
 
-//JSON Function
-String JSON_Extract(String lookfor)
+//Access point, DNS and page for the setup portal.  The SDK carries on trying the saved WiFi alongside
+void Portal_start()
 {
-  DynamicJsonBuffer jsonBuffer;
-  JsonObject &root = jsonBuffer.parseObject(sunAPIresponse);
-  JsonObject &data = root["results"];
-  return data[lookfor];
+  WiFi.mode(WIFI_AP_STA);
+  WiFi.softAP(portal_ssid);
+  portal_dns.start(53, "*", WiFi.softAPIP()); //Every name is us, so phones show the page as a sign in page
+
+  portal_server.on("/", HTTP_GET, Portal_page);
+  portal_server.on("/save", HTTP_POST, Portal_save);
+  portal_server.onNotFound(Portal_redirect);
+  portal_server.begin();
+  portal_open = true;
+
+  Serial.print("WiFi setup portal open (");
+  Serial.print(portal_ssid);
+  Serial.print(" ");
+  Serial.print(WiFi.softAPIP().toString());
+  Serial.println("), running offline");
 }
 
-//Connect to the WiFi and manage credentials
-void WiFi_and_Credentials()
+void Portal_stop()
 {
-  //2 ways to get WiFi.  ConnectToAP uses variables from build flags (platformio) or hard coded.
-  //WiFiManager will check if WiFi credentials are known (in Flash memory).  If not it will stary a webserver to collect details from user
-
-  //Use one of the follow lines depending on approach (build flags vs WiFiManager)
-  //ConnectToAP();           //Connect to Wifi (if not using Wifi Manager approach)
-  WiFiManager wifiManager;
+  if (portal_open == false)
+  {
+    return;
+  }
+  portal_server.stop();
+  portal_dns.stop();
+  WiFi.softAPdisconnect(true);
+  WiFi.mode(WIFI_STA);
+  portal_open = false;
+  Serial.println("WiFi setup portal closed");
+}
 
-  //SPIFFs section to Read and Write the saved credentials in Flash memory
-  //Check if APIaddress.txt exists.  If not create it and store the http address for sunrise API, if yes read it.
+//The portal page.  Settings are as in the text files (see Config_from_text()), blank ones are left as they are
+void Portal_page()
+{
+  String page = F("<!DOCTYPE html><html><head><meta name=\"viewport\" content=\"width=device-width\"><title>WiFi Lamp</title></head>"
+                  "<body><h3>WiFi Lamp</h3><form method=\"post\" action=\"/save\">"
+                  "WiFi name<br><input name=\"ssid\" maxlength=\"32\"><br>"
+                  "Password<br><input name=\"pass\" type=\"password\" maxlength=\"64\"><br>"
+                  "<p>Settings, blank = leave as they are</p>"
+                  "Latitude<br><input name=\"lat\" maxlength=\"10\"><br>"
+                  "Longitude<br><input name=\"lng\" maxlength=\"10\"><br>"
+                  "Mode (light mode, top light, flash, brightness)<br><input name=\"mode\" maxlength=\"4\"><br>"
+                  "UTC offset<br><input name=\"UTC\" maxlength=\"3\"><br>"
+                  "Chime (volume, then 24 hours 0/1)<br><input name=\"chime\" maxlength=\"25\"><br>"
+                  "<input type=\"submit\" value=\"Save\"></form></body></html>");
+  portal_server.send(200, "text/html", page);
+}
 
-  if (SPIFFS.begin())
-  {
-    Serial.println("SPIFFS Initialize....ok");
-  }
-  else
+//Form from Portal_page().  Keeps the settings for WiFi_online() and starts joining the WiFi given.  The portal stays
+//open until it's joined, so a wrong password can be typed again
+void Portal_save()
+{
+  String ssid = portal_server.arg("ssid");
+  String pass = portal_server.arg("pass");
+  if (ssid.length() == 0 || ssid.length() > 32 || pass.length() > 64)
   {
-    Serial.println("SPIFFS Initialization...failed");
-    SPIFFS.end();
+    portal_server.send(400, "text/html", "<p>WiFi name needed (up to 32 characters), password up to 64</p><a href=\"/\">Back</a>");
+    return;
   }
 
-  Serial.println("Trying files...");
-
-  if (SPIFFS.exists(HTTPfilename) == true)
-  {
-    Serial.println("File already exisits.  Read stored data.");
+  Portal_arg("lat", portal_latitude, sizeof(portal_latitude));
+  Portal_arg("lng", portal_longitude, sizeof(portal_longitude));
+  Portal_arg("mode", portal_mode, sizeof(portal_mode));
+  Portal_arg("UTC", portal_UTC, sizeof(portal_UTC));
+  Portal_arg("chime", portal_chime, sizeof(portal_chime));
 
-    //Read HTTP addresss file data
-    File f = SPIFFS.open(HTTPfilename, "r");
+  portal_server.send(200, "text/html", "<p>Joining the WiFi, the lamp will close this network when it's on</p>");
+  Serial.print("Portal: joining ");
+  Serial.println(ssid);
+  WiFi.begin(ssid.c_str(), pass.c_str()); //Saved by the SDK for next time
+  wifi_connect_millis = millis();
+}
 
-    if (!f)
-    {
-      Serial.println("file open failed");
-    }
-    else
-    {
-      Serial.println("Reading Data from HTTP file:");
-      //Data from file
+//Anything else (phone sign in checks etc) goes to the page
+void Portal_redirect()
+{
+  portal_server.sendHeader("Location", "http://" + WiFi.softAPIP().toString() + "/", true);
+  portal_server.send(302, "text/plain", "");
+}
 
-      size_t size = f.size();
+//A form field into text, "" if it's missing or blank
+void Portal_arg(const char *name, char *text, size_t size)
+{
+  String value = portal_server.arg(name);
+  value.trim();
+  strncpy(text, value.c_str(), size - 1);
+  text[size - 1] = 0;
+}
 
-      f.readBytes(sunrise_api_request, size);
+//Settings typed on the portal page over the ones in use.  Only what was entered changes, and nothing is saved if
+//nothing was entered (a lamp with no saved settings then stays on the defaults)
+void Portal_settings_apply()
+{
+  if (portal_latitude[0] == 0 && portal_longitude[0] == 0 && portal_mode[0] == 0 && portal_UTC[0] == 0 && portal_chime[0] == 0)
+  {
+    return;
+  }
 
-      f.close(); //Close file
-      Serial.printf("Read http adress for Sunrise/set API = %s\n", sunrise_api_request);
-      Serial.println("File Closed");
+  ConfigRecord record = config;
+  if (portal_latitude[0] != 0 && portal_longitude[0] != 0)
+  {
+    record.latitude = atof(portal_latitude);
+    record.longitude = atof(portal_longitude);
+  }
+  Config_merge_mode(record, portal_mode);
+  if (portal_UTC[0] != 0)
+  {
+    record.UTC = constrain(atoi(portal_UTC), -99, 99);
+  }
+  Config_merge_chime(record, portal_chime);
+  portal_latitude[0] = portal_longitude[0] = portal_mode[0] = portal_UTC[0] = portal_chime[0] = 0;
 
-      //Read Mode file data
-      File g = SPIFFS.open(modefilename, "r");
+  Config_check(record);
+  Config_update(record, true); //Redoes the sun times for a new place, saved a little later
+  config_loaded = true;
+  Serial.println("Settings from the setup portal page");
+}
 
-      if (!g)
-      {
-        Serial.println("file open failed");
-      }
-      else
-      {
-        Serial.println("Reading Data from Mode file:");
-        //Data from file
+//First time on the WiFi: settings from the portal page, then the network services and the first NTP request.
+//WiFi_check() has closed the portal, so port 80 is free for the local API
+void WiFi_online()
+{
+  wifi_online = true;
+  Serial.print("WiFi connected, IP ");
+  Serial.println(WiFi.localIP());
 
-        size_t size = g.size();
+  Portal_settings_apply();
 
-        g.readBytes(mode, size);
+  recovered_ssid = WiFi.SSID(); //Login for FTP and the local API
+  recovered_pass = WiFi.psk();
 
-        g.close(); //Close file
-        Serial.printf("Read Lamp Mode = %s\n", mode);
-        Serial.println("File Closed");
-      }
+  StartOTA();
+  Web_begin();
+  ftpSrv.begin(recovered_ssid.c_str(), recovered_pass.c_str()); //Root is LittleFS.  Ports 21, 50009 for PASV
+  ftpSrv.setTransferCallback(FTP_transfer);
 
-      //Read UTC file data
-      File h = SPIFFS.open(UTCfilename, "r");
+  //Blynk.begin(auth, ssid, pass);  //Blynk setup (if being used).
+  //Blynk.begin(auth, WiFi.SSID().c_str(), pass);
+  Blynk.config(auth); //Blynk.run() in loop() connects
+  Boot_mark("services");
 
-      if (!h)
-      {
-        Serial.println("file open failed");
-      }
-      else
-      {
-        Serial.println("Reading Data from UTC file:");
-        //Data from file
+  //******** GETTING THE TIME FROM NTP SERVER  ***********************************
+  //Ask now, Time_boot_check() in loop() picks up the reply then gets sunrise/set and draws the first LED frame.
+  //If the clock is already running (warm restart) update_epoch_time() does the first NTP pull instead
+  udp.begin(localPort);
+  if (time_valid == false)
+  {
+    Request_Time();
+    time_request_millis = millis();
+  }
+}
 
-        size_t size = h.size();
+//***************************************************************************************************
+//Warm restart.  A snapshot of the clock, 5min pressure ring and modes is kept in RTC
+//user memory, which survives ESP.restart() and crashes (not power off).  setup() carries on from it
+//straight away and the network refreshes everything in the background
+//***************************************************************************************************
 
-        h.readBytes(UTC, size);
+void RTC_save()
+{
+  if (time_valid == false)
+  {
+    return;
+  }
 
-        h.close(); //Close file
-        Serial.printf("Read UTC = %s\n", UTC);
-        Serial.println("File Closed");
-      }
+  RTCSnapshot snapshot;
+  memset(&snapshot, 0, sizeof(snapshot));
+  snapshot.magic = RTC_MAGIC;
+  snapshot.epoch = epoch;
+  snapshot.rtc_time = system_get_rtc_time();
+  snapshot.rtc_period = system_rtc_clock_cali_proc();
+  snapshot.UTCoffset = UTCoffset;
+  snapshot.flags = (working_mode ? RTC_WORKING_MODE : 0) | (storm_warning ? RTC_STORM : 0);
 
-      //Read chime file data
-      File i = SPIFFS.open(chimefilename, "r");
+  //Oldest first
+  snapshot.short_count = short_pressure_history.size();
+  for (int i = 0; i < snapshot.short_count; i++)
+  {
+    snapshot.short_pressure[i] = short_pressure_history.at(snapshot.short_count - 1 - i);
+  }
 
-      if (!i)
-      {
-        Serial.println("file open failed");
-      }
-      else
-      {
-        Serial.println("Reading Data from chime file:");
-        //Data from file
+  snapshot.crc = crc32_calc((const uint8_t *)&snapshot, sizeof(snapshot) - 4);
+  ESP.rtcUserMemoryWrite(RTC_OFFSET, (uint32_t *)&snapshot, sizeof(snapshot));
+  rtc_save_millis = millis();
+}
 
-        size_t size = i.size();
+//Full reset: don't bring anything back
+void RTC_clear()
+{
+  uint32_t zero = 0;
+  ESP.rtcUserMemoryWrite(RTC_OFFSET, &zero, sizeof(zero));
+}
 
-        i.readBytes(chime, size);
+//Keep the snapshot fresh so a crash or watchdog reset also comes back warm
+void RTC_check()
+{
+  if (millis() - rtc_save_millis > rtc_save_interval)
+  {
+    RTC_save();
+  }
+}
 
-        i.close(); //Close file
-        Serial.printf("Read chime = %s\n", chime);
-        Serial.println("File Closed");
-      }
+//Boot: use the snapshot if this is a restart (not power on) and it's good.  True if the time was restored
+bool RTC_restore()
+{
+  uint32_t reason = ESP.getResetInfoPtr()->reason;
+  if (reason == REASON_DEFAULT_RST || reason == REASON_DEEP_SLEEP_AWAKE)
+  {
+    return false; //Power on, RTC memory is rubbish
+  }
 
-      //WiFiManager will read stored WiFi Data, if it can't connect it will create a website to get new credentials.
-      wifiManager.autoConnect("WiFi_Lamp");
-    }
+  RTCSnapshot snapshot;
+  if (!ESP.rtcUserMemoryRead(RTC_OFFSET, (uint32_t *)&snapshot, sizeof(snapshot)) || snapshot.magic != RTC_MAGIC ||
+      snapshot.crc != crc32_calc((const uint8_t *)&snapshot, sizeof(snapshot) - 4) || snapshot.short_count > 36)
+  {
+    return false;
   }
 
-  else
+  //The RTC counter keeps going through a restart, so it gives the time spent restarting
+  uint32_t periods = system_get_rtc_time() - snapshot.rtc_time;
+  uint32_t elapsed_ms = ((uint64_t)periods * snapshot.rtc_period >> 12) / 1000;
+  if (elapsed_ms > 3600000UL)
   {
-    Serial.println("Filename DOESN'T exisit");
+    Serial.println("RTC snapshot too old");
+    return false;
+  }
 
-    //If file doesn't exist, get details from the user with wifimanager website
-    //create http address and store in APIaddress.txt file
+  epoch = snapshot.epoch + elapsed_ms / 1000;
+  epochstart = epoch;
+  startmillis = millis();
+  current_timestamp = epoch;
+  millis_unix_timestamp = millis();
+  millis_unix_timestamp_baseline = current_timestamp;
+  time_valid = true;
 
-    WiFiManagerParameter custom_longitude("Longitude", "Longitude", "", 10);
-    WiFiManagerParameter custom_latitude("Latitude", "Latitude", "", 10);
-    WiFiManagerParameter custom_mode("mode", "mode", "", 4);
-    WiFiManagerParameter custom_UTC("UTC", "UTC", "", 3);
-    WiFiManagerParameter custom_chime("chime", "chime", "", 25);
+  UTCoffset = snapshot.UTCoffset;
+  working_mode = (snapshot.flags & RTC_WORKING_MODE) != 0;
+  storm_warning = (snapshot.flags & RTC_STORM) != 0;
 
-    wifiManager.addParameter(&custom_longitude);
-    wifiManager.addParameter(&custom_latitude);
-    wifiManager.addParameter(&custom_mode);
-    wifiManager.addParameter(&custom_UTC);
-    wifiManager.addParameter(&custom_chime);
+  short_pressure_history.clear();
+  for (int i = 0; i < snapshot.short_count; i++)
+  {
+    short_pressure_history.push(snapshot.short_pressure[i]);
+  }
 
-    //WiFiManager will read stored WiFi Data, if it can't connect it will create a website to get new credentials
-    wifiManager.autoConnect("WiFi_Lamp");
+  decode_epoch(epoch);
 
-    //Check if new http address needed to be written to file.  If yes, create and write.
-    //Example: sunrise_api_request = "http://api.sunrise-sunset.org/json?lat=-41.2865&lng=174.7762"
-    //Mode of the Lamp (e.g 0, 1, 2) as separate files in SPIFFS
-    sprintf(sunrise_api_request, "http://api.sunrise-sunset.org/json?lat=%s&lng=%s", +custom_latitude.getValue(), custom_longitude.getValue());
-    sprintf(mode, "%s", +custom_mode.getValue());
-    sprintf(UTC, "%s", +custom_UTC.getValue());
-    sprintf(chime, "%s", +custom_chime.getValue());
-    //sprintf(alarm, "%s", +custom_alarm.getValue());
+  Serial.print("Warm restart from RTC memory, restart took (ms) ");
+  Serial.println(elapsed_ms);
+  return true;
+}
 
-    //Create New HTTP File And Write Data to It
-    //w=Write Open file for writing
-    File f = SPIFFS.open(HTTPfilename, "w");
+//***************************************************************************************************
+//Boot.  setup() only does the quick local parts and starts the slow ones (DFPlayer, NTP), which are
+//finished off from loop() by Audio_boot_check() and Time_boot_check().  Boot_mark() keeps a timeline
+//***************************************************************************************************
 
-    if (!f)
-    {
-      Serial.println("HTTP file open failed");
-    }
-    else
-    {
-      //Write data to file
-      Serial.println("Writing Data to HTTP File");
-      f.print(sunrise_api_request);
-      Serial.println("New file written");
-      f.close(); //Close file
-    }
+//Note the end of a boot phase
+void Boot_mark(const char *phase)
+{
+  unsigned long now = millis();
 
-    //Create New Mode File And Write Data to It
-    //w=Write Open file for writing
-    File g = SPIFFS.open(modefilename, "w");
+  if (boot_report_done == true)
+  {
+    //After the report, print as they happen
+    Serial.print("Boot ");
+    Serial.print(now);
+    Serial.print(" ms: ");
+    Serial.println(phase);
+    return;
+  }
 
-    if (!g)
-    {
-      Serial.println("Mode file open failed");
-    }
-    else
-    {
-      //Write data to file
-      Serial.println("Writing Data to Mode File");
-      g.print(mode);
-      Serial.println("New file written");
-      g.close(); //Close file
-    }
+  if (boot_marks < BOOT_MAX_MARKS)
+  {
+    boot_phase[boot_marks] = phase;
+    boot_millis[boot_marks] = now;
+    boot_marks++;
+  }
+}
 
-    //Create New UTC File And Write Data to It
-    //w=Write Open file for writing
-    File h = SPIFFS.open(UTCfilename, "w");
+//Print the timeline.  Times are from the SDK start, which is a few 10s of ms after power on
+void Boot_report()
+{
+  Serial.println("Boot timeline (ms, time in phase):");
+  unsigned long last = 0;
+  for (int i = 0; i < boot_marks; i++)
+  {
+    Serial.print(boot_millis[i]);
+    Serial.print("  (+");
+    Serial.print(boot_millis[i] - last);
+    Serial.print(")  ");
+    Serial.println(boot_phase[i]);
+    last = boot_millis[i];
+  }
+  boot_report_done = true;
+}
 
-    if (!h)
-    {
-      Serial.println("UTC file open failed");
-    }
-    else
-    {
-      //Write data to file
-      Serial.println("Writing Data to UTC File");
-      h.print(UTC);
-      Serial.println("New file written");
-      h.close(); //Close file
-    }
+//Draw the first LED frame as soon as the time (and so the forecast and day/night) is known
+void Boot_first_frame()
+{
+  if (working_mode == true)
+  {
+    nightday_DoTheLEDs();
+  }
+  else
+  {
+    weather_DotheLEDs();
+  }
+  count = millis();
 
-    //Create New chime File And Write Data to It
-    //w=Write Open file for writing
+  Boot_mark("first LED frame");
+  Boot_report();
+  Serial.print("First LED frame at (ms) ");
+  Serial.print(boot_millis[boot_marks - 1]);
+  Serial.println(" (target 2000)");
+}
 
-    File i = SPIFFS.open(chimefilename, "w");
+//Wait for the NTP reply asked for in setup(), asking again every 2 sec.  Once it's in the time is set up and everything
+//that needs it is done: pressure log update, forecast, sunrise/set and the first LED frame
+void Time_boot_check()
+{
+  if (millis() - time_poll_millis < time_poll_interval)
+  {
+    return;
+  }
+  time_poll_millis = millis();
 
-    if (!i)
-    {
-      Serial.println("chime file open failed");
-    }
-    else
+  if (!Check_Time())
+  {
+    if (millis() - time_request_millis > 2000)
     {
-      //Write data to file
-      Serial.println("Writing Data to chime File");
-      i.print(chime);
-      Serial.println("New file written");
-      i.close(); //Close file
+      Request_Time();
+      time_request_millis = millis();
     }
+    return;
   }
 
-  //Check File content or web entered details and correct if needed
-  //Get light mode from saved file and turn into an Int and check it's either 0, 1 or 2
-  //Get TARDIS from saved file and turn into an Int and check it's either 0, 1  (light on top of TARDIS)
-  char buffer[0];
-  char buffer1[0];
-  char buffer2[0];
-  char buffer3[0];
-  buffer[0] = mode[0];
-  buffer1[0] = mode[1];
-  buffer2[0] = mode[2];
-  buffer3[0] = mode[3];
+  time_valid = true;      //epoch, epochstart and startmillis were set from the best NTP reply by Check_Time()
+  current_timestamp = epoch;
+  Last_NTP_millis = millis();
+  NTP_Seconds_to_wait = NTPSecondstowait;
+  decode_epoch(epoch); //epoch has been updated, Now turn this into UTC clock_minutes_from_midnight
+  Boot_mark("time");
 
-  lightmode = atoi(buffer);
-  TARDIS = atoi(buffer1);
-  flash = atoi(buffer2);
-  int brightness_temp = atoi(buffer3);
+  millis_unix_timestamp = millis(); //millis time tracking reset to current millis when getting new NTP time
+  millis_unix_timestamp_baseline = current_timestamp;
 
-  //Check light mode is valid.
-  if (lightmode < 0 || lightmode > 2)
-  {
-    Serial.println("Light mode incorrect - overriding");
-    lightmode = 0;
-  }
-  Serial.print("Light mode used = ");
-  Serial.println(lightmode);
+  Serial.print("Current UNIX Timestamp: ");
+  Serial.println(current_timestamp);
+  Serial.print("Time & Date: ");
+  Serial.print(hour(current_timestamp));
+  Serial.print(":");
+  Serial.print(minute(current_timestamp));
+  Serial.print(":");
+  Serial.print(second(current_timestamp));
+  Serial.print("; ");
+  Serial.print(day(current_timestamp));
+  Serial.print(".");
+  Serial.print(month(current_timestamp)); // needed later: month as integer for Zambretti calcualtion
+  Serial.print(".");
+  Serial.println(year(current_timestamp));
 
-  //Check Top light entry is valid
-  if (TARDIS < 0 || TARDIS > 4)
+  if (saved_timestamp == 0)
   {
-    Serial.println("Top light incorrect - overriding");
-    TARDIS = 3;
+    saved_timestamp = current_timestamp; //No pressure log, FirstTimeRun() ran before the time was known
   }
-  Serial.print("Top light used = ");
-  Serial.println(TARDIS);
+  TS_pending_flush(); //Readings taken while waiting for the time
+  UpdateSPIFFS(); //Update the SPIFFs
+  Zambretti_calc();
 
-  //Check flash mode is valid.
-  if (flash < 0 || flash > 9)
-  {
-    Serial.println("Flash mode incorrect - overriding");
-    flash = 0;
-  }
+  Boot_first_frame(); //Sunrise/set was worked out by decode_epoch()
+}
 
-  Serial.print("Flash mode used = ");
-  Serial.println(flash);
+//Start the DFPlayer without waiting for it.  begin() with no reset returns straight away, the reset is sent here and
+//Audio_boot_check() waits for the card online message
+void Audio_begin()
+{
+  mySoftwareSerial.begin(9600);
+  myDFPlayer.setTimeOut(2000);
 
-  //Check brightness is valid.
-  if (brightness_temp < 1 || brightness_temp > 5)
+  Serial.println();
+  Serial.println(F("Initializing DFPlayer ..."));
+  myDFPlayer.begin(mySoftwareSerial, false, false); //Use softwareSerial to communicate with mp3.
+  myDFPlayer.reset();
+  audio_start_millis = millis();
+  audio_state = 0;
+}
+
+void Audio_boot_check()
+{
+  if (audio_state == 0)
   {
-    Serial.println("Brightness incorrect - overriding");
-    brightness_temp = 5;
+    if (myDFPlayer.available() && myDFPlayer.readType() == DFPlayerCardOnline)
+    {
+      Serial.println(F("DFPlayer Mini online."));
+      myDFPlayer.volume(20); //Set volume value. From 0 to 30
+      audio_state = 1;
+      Boot_mark("audio ready");
+    }
+    else if (millis() - audio_start_millis > audio_boot_timeout)
+    {
+      Serial.println(F("Unable to begin:"));
+      Serial.println(F("1.Please recheck the connection!"));
+      Serial.println(F("2.Please insert the SD card!"));
+      audio_state = -1; //Carry on without sound
+    }
   }
-  Serial.print("Brightness (1-5) = ");
-  Serial.println(brightness_temp);
-
-  //Entry x 5 +5 gives range of 55-255
-  brightness = (brightness_temp * 50) + 5;
-  brightness1 = brightness;
-
-  //Get volume from chime array
-  char buffer0[1];
-  buffer0[0] = chime[0];
-  mp3vol = atoi(buffer0);
-
-  //Set the mp3 volume form the chime array, this is used as a flag to run/no run sound functions in loop
-  if (mp3vol < 0 || mp3vol > 9)
+  else if (audio_state == 1 && boot_report_done == true)
   {
-    mp3vol = 0; //default to 0 in error state - no sound
-    Serial.println("mp3 volume incorrect - overriding");
+    //Speak the time once the boot is done.  A word a second from here, so loop() carries on in between
+    audio_clip_count = SpeakClock_clips(audio_clips);
+    audio_clip = 0;
+    audio_speak_millis = millis() - 1000;
+    audio_state = 2;
   }
-  else
+  else if (audio_state == 2 && millis() - audio_speak_millis >= 1000)
   {
-    mp3vol = mp3vol * 3.3; //30 is max volume, 9 x 3.3 = 29.7
-
-    if (mp3vol >= 29)
-    { //29 is close enough to 30, make it 30
-      mp3vol = 30;
+    if (audio_clip < audio_clip_count)
+    {
+      myDFPlayer.playFolder(1, audio_clips[audio_clip++]);
+    }
+    else
+    {
+      audio_state = 3; //Last word said
     }
+    audio_speak_millis = millis();
   }
-
-  //mp3_set_volume(mp3vol); //Set the mp3 volume
-  Serial.print("mp3 Volume = ");
-  Serial.println(mp3vol);
-
-  //Get UTC from saved file and turn into an Int and check it's between 0-24
-  char buffer4[3];
-  buffer4[0] = UTC[0];
-  buffer4[1] = UTC[1];
-  buffer4[2] = UTC[2];
-  localUTC = atoi(buffer4);
-
-  if (localUTC < -13 || localUTC > 13)
+  else if (audio_state == 3 && millis() - audio_speak_millis > 1500)
   {
-    Serial.println("UTC mode incorrect - overriding");
-    localUTC = 12; //Default to NZ (winter)
+    if (working_mode == true)
+    {
+      myDFPlayer.playFolder(2, 150);
+    }
+    else
+    {
+      myDFPlayer.playFolder(2, 151);
+    }
+    audio_state = 4;
   }
-  Serial.print("UTC used = ");
-  Serial.println(localUTC);
-
-  //Un-comment from WiFiManager.cpp
-  // void WiFiManager::startWPS() {
-  //   DEBUG_WM(F("START WPS"));
-  //   WiFi.beginWPSConfig();
-  //   DEBUG_WM(F("END WPS"));
-  // }
-
-  //   String WiFiManager::getSSID() {
-  //   if (_ssid == "") {
-  //     DEBUG_WM(F("Reading SSID"));
-  //     _ssid = WiFi.SSID();
-  //     DEBUG_WM(F("SSID: "));
-  //     DEBUG_WM(_ssid);
-  //   }
-  //   return _ssid;
-  //   }
-
-  //   String WiFiManager::getPassword() {
-  //   if (_pass == "") {
-  //     DEBUG_WM(F("Reading Password"));
-  //     _pass = WiFi.psk();
-  //     DEBUG_WM("Password: " + _pass);
-  //     //DEBUG_WM(_pass);
-  //   }
-  //   return _pass;
-  //   }
-
-  //Add last 2 lines into WiFiManager.h
-  // class WiFiManager
-  // {
-  //   public:
-  //     WiFiManager();
-  //     ~WiFiManager();
-
-  // 	String          getSSID();
-  // 	String          getPassword();
-
-  recovered_ssid = wifiManager.getSSID();
-  recovered_pass = wifiManager.getPassword();
 }
 
 //Update the time
@@ -2796,20 +6361,6 @@ void decode_epoch(unsigned long currentTime)
   minute_UTC = (currentTime % 3600) / 60;
   second_UTC = currentTime % 60;
 
-  clock_AMPM = "AM"; //Default to AM
-
-  //If it's 12 or greater (e.g 12 > 23) go to PM
-  if (hour_UTC >= 12)
-  {
-    clock_AMPM = "PM";
-  }
-
-  //If it's greater than 12 (e.g 13 > 23) deduct 12 to make 1 > 11
-  if (hour_UTC > 12)
-  {
-    hour_UTC = hour_UTC - 12;
-  }
-
   if (printNTP == 1 && verbose_output == 1)
   {
     Serial.print("UTC Hour: ");
@@ -2817,34 +6368,11 @@ void decode_epoch(unsigned long currentTime)
     Serial.print(",   Minute: ");
     Serial.print(minute_UTC);
     Serial.print(",   Second: ");
-    Serial.print(second_UTC);
-    Serial.print(",   clock_AMPM: ");
-    Serial.println(clock_AMPM);
+    Serial.println(second_UTC);
     Serial.println();
   }
 
-  //Work out Hours/min into minutes from midnight to Calculate if it's AM or PM time
-  working_hourtomin = hour_UTC;
-
-  //PM add 12.  e,g 1PM = 13:00
-  if (clock_AMPM == "PM")
-  {
-    working_hourtomin = hour_UTC + 12;
-  }
-
-  //Midnight = 0
-  if (clock_AMPM == "AM" && hour_UTC == 12)
-  {
-    working_hourtomin = 0;
-  }
-
-  //Noon = 12
-  if (clock_AMPM == "PM" && hour_UTC == 12)
-  {
-    working_hourtomin = 12;
-  }
-
-  clock_minutes_from_midnight = ((working_hourtomin * 60) + minute_UTC);
+  clock_minutes_from_midnight = (currentTime % 86400L) / 60;
 
   //Get local minutes for day/night calc
   local_clock_minutes_from_midnight = clock_minutes_from_midnight + ((localUTC + UTCoffset) * 60);
@@ -2872,29 +6400,8 @@ void decode_epoch(unsigned long currentTime)
     Serial.println();
   }
 
-  //Work out Hours/min into minutes from midnight
-  working_hourtomin = hour_sunrise;
-
-  //PM add 12
-  if (strcmp(SR_AMPM, "P") == 0)
-  {
-    working_hourtomin = hour_sunrise + 12;
-  }
-
-  //Midnight = 0
-  if (strcmp(SR_AMPM, "A") == 0 && hour_sunrise == 12)
-  {
-    working_hourtomin = 0;
-  }
-
-  //Noon = 12
-  if (strcmp(SR_AMPM, "P") == 0 && hour_sunrise == 12)
-  {
-    working_hourtomin = 12;
-  }
-
-  //UTC number of minutes from midnight until sunrise qwerty
-  sunrise_minutes_from_midnight = ((working_hourtomin * 60) + minute_sunrise);
+  //UTC minutes from midnight of sunrise/set, worked out on the device once a day
+  Solar_calc(currentTime);
 
   //Convert UTC sunrise_minutes_from_midnight into local_sunrise_minutes_from_midnight with UTC
   local_sunrise_minutes_from_midnight = sunrise_minutes_from_midnight + ((localUTC + UTCoffset) * 60);
@@ -2911,30 +6418,6 @@ void decode_epoch(unsigned long currentTime)
     local_sunrise_minutes_from_midnight = local_sunrise_minutes_from_midnight + 1440;
   }
 
-  //Work out Hours/min into minutes from midnight
-  working_hourtomin = hour_sunset;
-
-  //PM add 12
-  if (strcmp(SS_AMPM, "P") == 0)
-  {
-    working_hourtomin = hour_sunset + 12;
-  }
-
-  //Midnight = 0
-  if (strcmp(SS_AMPM, "A") == 0 && hour_sunset == 12)
-  {
-    working_hourtomin = 0;
-  }
-
-  //Noon = 12
-  if (strcmp(SS_AMPM, "P") == 0 && hour_sunset == 12)
-  {
-    working_hourtomin = 12;
-    Serial.println();
-  }
-
-  sunset_minutes_from_midnight = ((working_hourtomin * 60) + minute_sunset);
-
   //Convert UTC sunrise_minutes_from_midnight into local_sunrise_minutes_from_midnight with UTC
   local_sunset_minutes_from_midnight = sunset_minutes_from_midnight + ((localUTC + UTCoffset) * 60);
 
@@ -2993,7 +6476,8 @@ void Flip_modes(){
    }
 }
 
-void SpeakClock()
+//The mp3s (folder 1) that say the local time, in order: hour, minute (and a second minute word), AM/PM.  Returns how many
+int SpeakClock_clips(int *clips)
 {
 
   int hour_mp3 = 0;
@@ -3043,27 +6527,35 @@ void SpeakClock()
   Serial.println(minute_UTC);
   Serial.print("Speaking mp3  Hour: ");
   Serial.print(hour_mp3);
-  myDFPlayer.playFolder(1, hour_mp3); //Play selected mp3 in folder mp3
-  delay(1000);
   Serial.print(",  Minute: ");
-  Serial.print(1, minute_mp3);
-  myDFPlayer.playFolder(1, minute_mp3); //Play selected mp3 in folder mp3
-  delay(1000);
+  Serial.print(minute_mp3);
   Serial.print(" / ");
   Serial.print(minute_mp3b);
   Serial.print(" AMPM: ");
+  Serial.println(AMPMmp3);
+  Serial.println("****************");
+  Serial.println();
 
+  int count = 0;
+  clips[count++] = hour_mp3;
+  clips[count++] = minute_mp3;
   if (minute_mp3b != 999)
   {
-    myDFPlayer.playFolder(1, minute_mp3b);
-    delay(1000);
+    clips[count++] = minute_mp3b;
   }
+  clips[count++] = AMPMmp3;
+  return count;
+}
 
-  Serial.println(AMPMmp3);
-  Serial.println("****************");
-  Serial.println();
-  myDFPlayer.playFolder(1, AMPMmp3); //Play selected mp3 in folder mp3
-
-  delay(1000);
+//Say the time now, a second per word.  Blocks; the boot speech goes through Audio_boot_check() instead
+void SpeakClock()
+{
+  int clips[4];
+  int count = SpeakClock_clips(clips);
+  for (int i = 0; i < count; i++)
+  {
+    myDFPlayer.playFolder(1, clips[i]); //Play selected mp3 in folder mp3
+    delay(1000);
+  }
   Serial.println();
 }
\ No newline at end of file
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# Cross check the lamp's sunrise/sunset against api.sunrise-sunset.org from a computer on the same network.
+# The lamp's times come from GET /sunrise (UTC minutes from midnight), the API's from the same request the
+# lamp makes itself (formatted=0).  Standard library only.
+#
+#   python3 tools/sun_check.py 192.168.1.50 -41.2865 174.7762
+#   python3 tools/sun_check.py 192.168.1.50 -41.2865 174.7762 --user admin --password secret --tolerance 2
+
+import argparse
+import base64
+import json
+import sys
+import urllib.request
+
+
+def get_json(url, user=None, password=None):
+    request = urllib.request.Request(url)
+    if user is not None:
+        token = base64.b64encode(("%s:%s" % (user, password or "")).encode()).decode()
+        request.add_header("Authorization", "Basic " + token)
+    with urllib.request.urlopen(request, timeout=10) as reply:
+        return json.load(reply)
+
+
+# "2024-06-21T19:47:12+00:00" as UTC minutes from midnight, rounded like the lamp does
+def iso_minutes(text):
+    hour, minute, second = int(text[11:13]), int(text[14:16]), int(text[17:19])
+    return (hour * 60 + minute + (1 if second >= 30 else 0)) % 1440
+
+
+# Minutes apart round the clock, so 1439 and 0 are 1 apart
+def minutes_apart(a, b):
+    difference = abs(a - b) % 1440
+    return min(difference, 1440 - difference)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare the lamp's sun times with api.sunrise-sunset.org")
+    parser.add_argument("lamp", help="lamp address, e.g. 192.168.1.50")
+    parser.add_argument("lat", help="latitude the lamp is set to")
+    parser.add_argument("lng", help="longitude the lamp is set to")
+    parser.add_argument("--user", help="web login, if the lamp has one")
+    parser.add_argument("--password")
+    parser.add_argument("--tolerance", type=int, default=2, help="minutes apart that still pass (default 2)")
+    args = parser.parse_args()
+
+    lamp = get_json("http://%s/sunrise" % args.lamp, args.user, args.password)
+    api = get_json("http://api.sunrise-sunset.org/json?lat=%s&lng=%s&formatted=0" % (args.lat, args.lng))
+    if api.get("status") != "OK":
+        print("API said %s" % api.get("status"))
+        return 2
+
+    worst = 0
+    for name in ("sunrise", "sunset"):
+        api_minutes = iso_minutes(api["results"][name])
+        apart = minutes_apart(lamp[name], api_minutes)
+        worst = max(worst, apart)
+        print("%-8s lamp %4d  api %4d  apart %d" % (name, lamp[name], api_minutes, apart))
+    print("lamp's own check: api_check %s, api_sunrise %d, api_sunset %d" % (lamp["api_check"], lamp["api_sunrise"], lamp["api_sunset"]))
+
+    if worst > args.tolerance:
+        print("FAIL: more than %d minutes apart" % args.tolerance)
+        return 1
+    print("OK")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())